@@ -247,19 +247,51 @@ RECENT REVISION HISTORY:
 //
 // I/O callbacks allow you to read from arbitrary sources, like packaged
 // files or some other source. Data read from callbacks are processed
-// through a small internal buffer (currently 128 bytes) to try to reduce
-// overhead.
+// through a small internal buffer (128 bytes by default) to try to reduce
+// overhead. If each read is expensive, make the buffer bigger with
+//
+//     #define STBI_IO_BUFFER_SIZE 65536
+//
+// (the buffer is part of a context that lives on the stack, so it also
+// grows the stack use of every load by that much). It must be at least 128
+// bytes, since the format tests read the start of the file and can only
+// rewind within the first buffer.
 //
 // The three functions you must define are "read" (reads some bytes of data),
 // "skip" (skips some bytes of data), "eof" (reports if the stream is at the end).
 //
+// If your source already has the data in memory (say, decompressed pieces of
+// an archive), you can avoid the copy into the buffer: fill in a
+// stbi_io_next_callbacks with a "next" function that returns a pointer to
+// the next bytes (io.read is not used; skip and eof are used as usual), and
+// pass it to stbi_load_from_next_callbacks, stbi_load_16_from_next_callbacks,
+// stbi_loadf_from_next_callbacks or stbi_info_from_next_callbacks. The bytes
+// "next" returns only need to stay valid until the next call to any of the
+// callbacks.
+//
+// Files (stbi_load, stbi_load_from_file, etc.) go through the same buffer
+// by default. If you
+//
+//     #define STBI_MMAP
+//
+// on a POSIX system, stb_image instead maps the file into memory and decodes
+// it exactly as stbi_load_from_memory would, falling back to the buffered
+// reads for pipes and anything else that can't be mapped. This needs POSIX
+// declarations (fileno) visible, which strict modes like -std=c99 hide
+// unless you define _POSIX_C_SOURCE. Note that if the file is truncated by
+// someone else while it is being decoded, accessing the missing part of the
+// mapping crashes (SIGBUS).
+//
 // ===========================================================================
 //
 // SIMD support
 //
-// The JPEG decoder will try to automatically use SIMD kernels on x86 when
-// supported by the compiler. For ARM Neon support, you must explicitly
-// request it.
+// The JPEG decoder, the PNG unfiltering (for 3 and 4 channel images,
+// 8 or 16 bits per channel), the HDR loader's RGBE-to-float conversion and
+// the common req_comp conversions (grey/grey+alpha/RGB to RGBA, RGBA to RGB,
+// RGB(A) to grey, 8 or 16 bits per channel) will try to automatically use
+// SIMD kernels on x86 when supported by the compiler. For ARM Neon support, you must
+// explicitly request it.
 //
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
@@ -270,12 +302,168 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// Likewise, 256-bit AVX2 versions of the IDCT, chroma upsampling and color
+// conversion loops are only used if you define STBI_AVX2, since there's no
+// run-time test for them; only do so in builds that target AVX2 machines.
+// With GCC/Clang you also need to compile with -mavx2 (or -march=...) or
+// the define is ignored. Output is identical to the SSE2 and C paths.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
 // ===========================================================================
 //
+// Multithreading
+//
+// stb_image never creates threads, but you can give it a way to run work
+// on yours. Install a parallel-for hook with
+//
+//     stbi_set_parallel_for(my_parallel_for, my_pool);
+//
+// (or stbi_set_parallel_for_thread() to affect only the calling thread),
+// and decoders that can split an image into independent pieces will call
+//
+//     my_parallel_for(my_pool, task, task_data, task_count);
+//
+// which must call task(task_data, i) exactly once for every i in
+// [0,task_count), in any order and on any threads, and return only after
+// all of them have finished. Running them in a loop on the calling thread
+// is a valid (if pointless) implementation. Pass NULL to uninstall.
+//
+// Currently this is used by the JPEG decoder for baseline images that
+// contain restart markers (most camera JPEGs do), when loading from memory:
+// each restart interval is entropy-decoded independently. Baseline images
+// without restart markers, and baseline images read through callbacks or
+// FILEs, are decoded on the calling thread as usual. For progressive JPEGs
+// the final dequantize+IDCT pass over the stored coefficients is split into
+// one task per block row and component, a few MCU rows at a time. The
+// output is always identical to single-threaded decoding.
+//
+// ===========================================================================
+//
+// Memory allocation
+//
+// By default memory comes from malloc/realloc/free, or from your STBI_MALLOC,
+// STBI_REALLOC(_SIZED) and STBI_FREE macros. To choose the allocator at run
+// time, e.g. a per-thread arena, install one with
+//
+//     stbi_set_allocator_thread(&my_allocator);
+//
+// (or stbi_set_allocator() for all threads). Every allocation stb_image
+// makes then goes through it, and the realloc callback is told the old size,
+// so a bump allocator with a no-op free works: everything but the returned
+// image is freed by the time a load function returns, so resetting the arena
+// once you're done with the image recycles all of it, and a steady stream of
+// decodes never touches the heap. Images must be released with the allocator
+// that was current when they were loaded (stbi_image_free uses the current
+// one). Decoder tasks given to a parallel-for hook never allocate.
+//
+// ===========================================================================
+//
+// Streaming
+//
+// The stbi_load_rows* functions decode an image without ever holding all
+// of its pixels at once: the image is handed to your callback piece by piece
+//
+//     int my_rows(void *user, stbi_uc const *rows, int stride_in_bytes, int y, int num_rows);
+//
+// as num_rows scanlines starting at image row y, in the same format stbi_load
+// would have produced (so desired_channels and the flip flag still apply).
+// The pointer is only valid during the call. Rows are usually delivered
+// top to bottom, but not always (bottom-up BMPs and TGAs arrive bottom row
+// first), so always use y. x, y and channels_in_file are filled in before
+// the first call. Return 0 from the callback to stop decoding, in which case
+// the load fails.
+//
+// Baseline JPEG (in bands of one MCU row, typically 8 or 16 scanlines),
+// non-interlaced PNG, BMP, TGA and PNM are decoded with a working set of a
+// few rows. Progressive JPEGs have to keep all of their DCT coefficients
+// until the last scan, but the pixels are then produced and passed on a few
+// MCU rows at a time. For everything else, and for the few files that can't
+// be decoded in order (multi-scan baseline JPEGs, interlaced PNGs, 32-bit
+// BMPs with an alpha channel), the image is decoded in full and then passed
+// on in one call, so the streaming API is always safe to use, just not always
+// cheaper.
+//
+// The stbi_load_into* functions use the same machinery to decode into memory
+// you provide, e.g. a padded or aligned texture staging buffer:
+//
+//     stbi_info_from_memory(buffer, len, &x, &y, &n);
+//     ... get a buffer with at least y rows of stride >= x*4 bytes ...
+//     ok = stbi_load_into_from_memory(buffer, len, &x, &y, &n, 4, out, stride, rows);
+//
+// For the formats listed above this avoids allocating and copying the whole
+// image; the others are still decoded into a temporary image first.
+//
+// The stbi_load_region* functions decode a rectangle out of a large image,
+// e.g. a 512x512 tile of a scanned page:
+//
+//     tile = stbi_load_region_from_memory(buffer, len, &w, &h, &n, 3, x0, y0, 512, 512);
+//
+// Decoding stops after the last row of the rectangle. Baseline JPEGs skip the
+// IDCT and color conversion outside it, and skip the Huffman decoding too for
+// restart intervals that lie entirely outside it. Non-interlaced PNGs only
+// unfilter each row up to the right edge of the rectangle. Everything else
+// is decoded as a whole and then cropped.
+//
+// The stbi_push_* functions are for images that arrive a piece at a time,
+// e.g. over the network, and for decoding a big image a slice at a time
+// without holding up the thread that does it:
+//
+//     stbi_push *p = stbi_push_open(4);
+//     for (;;) {
+//        int r = stbi_push_decode(p, 65536);   // at most ~64K pixels this call
+//        if (r == STBI_PUSH_NEED_DATA) {
+//           ... wait for data, or stop if it's not coming ...
+//           stbi_push_data(p, data, len, is_last_piece);
+//        } else if (r != STBI_PUSH_IN_PROGRESS)
+//           break;                             // STBI_PUSH_DONE or STBI_PUSH_ERROR
+//     }
+//     image = stbi_push_image(p, &x, &y, &n);  // NULL unless it's done
+//     stbi_push_close(p);
+//
+// Baseline JPEGs and non-interlaced PNGs are decoded as the data comes in,
+// in steps of roughly the given number of output pixels (at least one MCU
+// row or scanline per step). stbi_push_info gives their size as soon as the
+// headers are in, and they are done once the last row is, without looking
+// at whatever follows the image data. Everything else is decoded in a
+// single step once is_last has been passed. The input is kept until
+// stbi_push_close, so the memory used is that of the file plus the image.
+//
+// ===========================================================================
+//
+// Profiling
+//
+// If you define STBI_PROFILE (wherever you include the implementation, and
+// wherever you call the function below), each load counts the CPU clocks it
+// spends in each stage of decoding, and afterwards
+//
+//     stbi_profile_info info;
+//     stbi_get_profile_info(&info);
+//
+// returns the counts for the last stbi_load* call on the calling thread
+// (stbi_push_* decoding isn't covered). The stages:
+//
+//     total     the whole load; the others are parts of it
+//     header    parsing headers, markers and chunks (JPEG and PNG)
+//     entropy   Huffman decoding (JPEG), inflate (PNG)
+//     idct      dequantize and IDCT (JPEG), unfiltering rows (PNG)
+//     upsample  chroma upsampling (JPEG)
+//     color     YCbCr/CMYK to RGB (JPEG), transparency and palettes (PNG)
+//     convert   converting to desired_channels, 8/16 bits or float
+//     alloc     malloc, realloc and free
+//
+// A stage's count never includes time spent in other stages, so total minus
+// the rest is the time spent elsewhere, including in the loaders of other
+// formats. Work a parallel-for hook runs on other threads isn't counted.
+// The clocks come from rdtsc on x86 and the virtual counter on ARM64, or
+// from your own STBI_PROFILE_FUNC(). The timing itself slows decoding down a
+// little, so don't leave it on in builds you measure the speed of otherwise.
+// Without STBI_PROFILE none of this is compiled in.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -415,6 +603,12 @@ typedef struct
    int      (*eof)   (void *user);                       // returns nonzero if we are at end of file/data
 } stbi_io_callbacks;
 
+typedef struct
+{
+   stbi_io_callbacks io;                                 // read is not used
+   stbi_uc const *(*next)(void *user,int size,int *len); // return up to 'size' bytes, setting *len to how many (0 at end of file/data)
+} stbi_io_next_callbacks;
+
 ////////////////////////////////////
 //
 // 8-bits-per-channel interface
@@ -422,6 +616,7 @@ typedef struct
 
 STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_uc *stbi_load            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -431,12 +626,159 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
+
+// animated GIFs one frame at a time, instead of all frames in one block:
+//
+//     stbi_gif_frames *g = stbi_gif_frames_from_memory(buffer, len, &x, &y, &n, 4);
+//     while ((frame = stbi_gif_frames_next(g, &delay_in_ms)) != NULL)
+//        ... frame is x*y pixels of desired_channels, as stbi_load_gif_from_memory
+//            would have returned it; only valid until the next call ...
+//     stbi_gif_frames_close(g);
+//
+// memory use is a few frames' worth, however long the animation is. like
+// stbi_load_gif_from_memory, a corrupt frame ends the animation early
+typedef struct stbi_gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_file     (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+STBIDEF stbi_uc const   *stbi_gif_frames_next (stbi_gif_frames *g, int *delay_in_ms);
+STBIDEF void             stbi_gif_frames_close(stbi_gif_frames *g);
+#endif
+
+#ifndef STBI_NO_JPEG
+// JPEG components exactly as they are coded, without chroma upsampling or
+// color conversion; each plane is at its own (subsampled) resolution:
+//
+//     stbi_jpeg_plane planes[4];
+//     stbi_uc *mem = stbi_jpeg_load_planes_from_memory(buffer, len, &x, &y, &n, &colorspace, planes);
+//     ... sample (i,j) of plane k is planes[k].data[j*planes[k].stride + i],
+//         for i < planes[k].w, j < planes[k].h, k < n ...
+//     stbi_image_free(mem);
+//
+// all planes live in the one returned block. stbi_set_jpeg_downscale_on_load
+// applies to them; stbi_set_flip_vertically_on_load does not (always top-down)
+enum
+{
+   STBI_JPEG_GREY,   // 1 plane
+   STBI_JPEG_YCBCR,  // 3 planes (4 if the file has an extra, unused one)
+   STBI_JPEG_RGB,    // 3 planes, no color transform
+   STBI_JPEG_CMYK,   // 4 planes, inverted as Adobe writes them
+   STBI_JPEG_YCCK    // 4 planes, Adobe YCCK: CMY coded as YCbCr, plus K
+};
+
+typedef struct
+{
+   stbi_uc *data;
+   int w, h;           // in samples
+   int stride;         // in bytes, at least w
+   int h_samp, v_samp; // sampling factors; the plane is (h_samp/max h_samp) of the width
+} stbi_jpeg_plane;
+
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4]);
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4]);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_jpeg_load_planes          (char const *filename, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4]);
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_file(FILE *f, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4]);
+#endif
+
+// a JPEG decoder to use for many images of the same kind, e.g. frames from a
+// camera: it keeps its working buffers from one image to the next, and its
+// Huffman tables, which are only rebuilt when a DHT segment differs from the
+// one they were built from:
+//
+//     stbi_jpeg_decoder *d = stbi_jpeg_decoder_create();
+//     for (each frame) {
+//        stbi_uc *data = stbi_jpeg_decoder_load_from_memory(d, buffer, len, &x, &y, &n, 3);
+//        ...
+//        stbi_image_free(data);
+//     }
+//     stbi_jpeg_decoder_free(d);
+//
+// stbi_jpeg_decoder_load_into decodes into your buffer like stbi_load_into,
+// so a baseline frame needs no allocation at all once the decoder has seen
+// one of that size. Tables and buffers carry over, so a decoder must only be
+// used by one thread at a time, and an image without DHT or DQT segments is
+// decoded with the tables of the image before it
+typedef struct stbi_jpeg_decoder stbi_jpeg_decoder;
+
+STBIDEF stbi_jpeg_decoder *stbi_jpeg_decoder_create(void);
+STBIDEF void               stbi_jpeg_decoder_free(stbi_jpeg_decoder *d);
+STBIDEF stbi_uc *stbi_jpeg_decoder_load_from_memory(stbi_jpeg_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_jpeg_decoder_load_into       (stbi_jpeg_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride_in_bytes, int out_height);
 #endif
 
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
 
+////////////////////////////////////
+//
+// 8-bits-per-channel streaming interface (see "Streaming" above)
+//
+// rows are passed to the callback as they're decoded; returns 1 on success
+
+typedef int stbi_rows_callback(void *user, stbi_uc const *rows, int stride_in_bytes, int y, int num_rows);
+
+STBIDEF int stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *rows, void *rows_user);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *rows, void *rows_user);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *rows, void *rows_user);
+STBIDEF int stbi_load_rows_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, stbi_rows_callback *rows, void *rows_user);
+#endif
+
+// same, but rows are written straight into your buffer: row y of the image
+// goes to out + y*out_stride_in_bytes. desired_channels must be 1..4, and
+// out non-NULL with a positive stride and height; fails without writing
+// anything if the image is wider than the stride or taller than out_height
+// rows
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride_in_bytes, int out_height);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride_in_bytes, int out_height);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride_in_bytes, int out_height);
+STBIDEF int stbi_load_into_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_stride_in_bytes, int out_height);
+#endif
+
+// decode just the region_w x region_h rectangle at (region_x,region_y) of the
+// image stbi_load would return (so after any flip), clipped to the image; *x
+// and *y get the clipped size. Free the result with stbi_image_free
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+STBIDEF stbi_uc *stbi_load_region_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, int region_x, int region_y, int region_w, int region_h);
+#endif
+
+// decode an image as its data is passed in; see "Streaming" above.
+// stbi_push_data returns 0 if out of memory. stbi_push_decode does one step
+// of at most about budget_in_pixels output pixels (0 for no limit) and says
+// what to do next; STBI_PUSH_DONE and STBI_PUSH_ERROR are returned from then
+// on, and stbi_failure_reason() says what went wrong. stbi_push_info returns
+// 1 once the size is known. stbi_push_image hands over the image once it's
+// done, to be freed with stbi_image_free
+typedef struct stbi_push stbi_push;
+
+enum
+{
+   STBI_PUSH_ERROR = -1,
+   STBI_PUSH_NEED_DATA,       // call stbi_push_data, then stbi_push_decode again
+   STBI_PUSH_IN_PROGRESS,     // call stbi_push_decode again
+   STBI_PUSH_DONE
+};
+
+STBIDEF stbi_push *stbi_push_open  (int desired_channels);
+STBIDEF int        stbi_push_data  (stbi_push *p, stbi_uc const *data, int len, int is_last);
+STBIDEF int        stbi_push_decode(stbi_push *p, int budget_in_pixels);
+STBIDEF int        stbi_push_info  (stbi_push *p, int *x, int *y, int *channels_in_file);
+STBIDEF stbi_uc   *stbi_push_image (stbi_push *p, int *x, int *y, int *channels_in_file);
+STBIDEF void       stbi_push_close (stbi_push *p);
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -444,6 +786,7 @@ STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wch
 
 STBIDEF stbi_us *stbi_load_16_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_us *stbi_load_16_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_16_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
 #ifndef STBI_NO_STDIO
 STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -457,6 +800,7 @@ STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_i
 #ifndef STBI_NO_LINEAR
    STBIDEF float *stbi_loadf_from_memory     (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
    STBIDEF float *stbi_loadf_from_callbacks  (stbi_io_callbacks const *clbk, void *user, int *x, int *y,  int *channels_in_file, int desired_channels);
+   STBIDEF float *stbi_loadf_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
 
    #ifndef STBI_NO_STDIO
    STBIDEF float *stbi_loadf            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
@@ -487,12 +831,15 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 // on most compilers (and ALL modern mainstream compilers) this is threadsafe
 STBIDEF const char *stbi_failure_reason  (void);
 
-// free the loaded image -- this is just free()
+// free the loaded image, through the allocator that is current (see
+// stbi_set_allocator); that must be the one it was loaded with, and if a
+// custom allocator is in use the image can't be released with plain free()
 STBIDEF void     stbi_image_free      (void *retval_from_stbi_load);
 
 // get image dimensions & components without fully decoding
 STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
+STBIDEF int      stbi_info_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *comp);
 STBIDEF int      stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len);
 STBIDEF int      stbi_is_16_bit_from_callbacks(stbi_io_callbacks const *clbk, void *user);
 
@@ -514,7 +861,9 @@ STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultipl
 // or just pass them through "as-is"
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
-// flip the image vertically, so the first pixel in the output array is the bottom left
+// flip the image vertically, so the first pixel in the output array is the bottom left.
+// JPEG, PNG, BMP and TGA write their rows straight to the flipped places, so
+// this costs nothing for them; other formats are flipped after loading
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
 // as above, but only applies to images loaded on the thread that calls the function
@@ -524,6 +873,59 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// decode JPEGs at 1/2, 1/4 or 1/8 of their size (rounded up), by running a
+// reduced IDCT on each block; much faster than decoding at full size and
+// downsampling. 1 (the default) decodes at full size. other formats are
+// unaffected, so use the returned width & height.
+STBIDEF void stbi_set_jpeg_downscale_on_load(int scale_denominator);
+STBIDEF void stbi_set_jpeg_downscale_on_load_thread(int scale_denominator);
+
+// multithreaded decoding: install a parallel-for hook and decoders that can split
+// their work into independent tasks will hand them to it (see "Multithreading" above)
+typedef void stbi_parallel_task(void *task_data, int task_index);
+typedef void stbi_parallel_for(void *hook_user, stbi_parallel_task *task, void *task_data, int task_count);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *hook, void *hook_user);
+STBIDEF void stbi_set_parallel_for_thread(stbi_parallel_for *hook, void *hook_user);
+
+// custom allocation: everything stb_image allocates, including the images it
+// returns, goes through these instead of STBI_MALLOC/STBI_REALLOC_SIZED/STBI_FREE
+// (see "Memory allocation" above). the struct must stay valid while installed;
+// pass NULL to go back to the STBI_ macros
+typedef struct
+{
+   void *(*malloc_fn)(void *user, size_t size);
+   void *(*realloc_fn)(void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free_fn)(void *user, void *p);
+   void *user;
+} stbi_allocator;
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator);
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator);
+
+// profiling: clocks spent in each stage of the last load on the calling
+// thread (see "Profiling" above); only there if STBI_PROFILE is defined
+#ifdef STBI_PROFILE
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi_profile_clocks;
+#else
+#include <stdint.h>
+typedef uint64_t stbi_profile_clocks;
+#endif
+
+typedef struct
+{
+   stbi_profile_clocks total;
+   stbi_profile_clocks header;
+   stbi_profile_clocks entropy;
+   stbi_profile_clocks idct;
+   stbi_profile_clocks upsample;
+   stbi_profile_clocks color;
+   stbi_profile_clocks convert;
+   stbi_profile_clocks alloc;
+} stbi_profile_info;
+
+STBIDEF void stbi_get_profile_info(stbi_profile_info *info);
+#endif
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -534,6 +936,20 @@ STBIDEF int   stbi_zlib_decode_buffer(char *obuffer, int olen, const char *ibuff
 STBIDEF char *stbi_zlib_decode_noheader_malloc(const char *buffer, int len, int *outlen);
 STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen);
 
+// streaming inflate, for data too big to hold in memory: pass the input in
+// pieces of any size and take the output in pieces of any size. the stream
+// keeps the 32KB window and about 200KB of buffers. each call takes what it
+// can of 'in' (*in_used bytes; pass the rest again next time) and writes up
+// to out_len bytes to 'out' (*out_written). set is_last_input once 'in'
+// holds the end of the data. returns 1 once all the output has been written,
+// 0 to be called again (with more input if it took all of it, or with more
+// room for output if it filled 'out'), or -1 on error
+typedef struct stbi_zlib_stream stbi_zlib_stream;
+
+STBIDEF stbi_zlib_stream *stbi_zlib_stream_open(int parse_header);
+STBIDEF int  stbi_zlib_stream_inflate(stbi_zlib_stream *z, const char *in, int in_len, int *in_used, char *out, int out_len, int *out_written, int is_last_input);
+STBIDEF void stbi_zlib_stream_close(stbi_zlib_stream *z);
+
 
 #ifdef __cplusplus
 }
@@ -591,7 +1007,14 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <limits.h>
 
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
-#include <math.h>  // ldexp, pow
+#include <math.h>  // pow
+#endif
+
+#if defined(STBI_MMAP) && !defined(STBI_NO_STDIO) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #ifndef STBI_NO_STDIO
@@ -750,7 +1173,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#ifdef STBI_SSE2
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +1184,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#ifdef STBI_SSE2
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -779,6 +1202,15 @@ static int stbi__sse2_available(void)
 #undef STBI_NEON
 #endif
 
+// x86 AVX2; builds on the SSE2 code, and needs the compiler to allow AVX2
+#if defined(STBI_AVX2) && (!defined(STBI_SSE2) || (defined(__GNUC__) && !defined(__AVX2__)))
+#undef STBI_AVX2
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+#endif
+
 #ifdef STBI_NEON
 #include <arm_neon.h>
 #ifdef _MSC_VER
@@ -796,10 +1228,48 @@ static int stbi__sse2_available(void)
 #define STBI_MAX_DIMENSIONS (1 << 24)
 #endif
 
+// at least 128: stbi__rewind only goes back to the start of the first
+// buffer, and the format tests look at up to ~92 bytes
+#ifndef STBI_IO_BUFFER_SIZE
+#define STBI_IO_BUFFER_SIZE 128
+#endif
+#if STBI_IO_BUFFER_SIZE < 128
+#error "STBI_IO_BUFFER_SIZE must be at least 128"
+#endif
+
 ///////////////////////////////////////////////
 //
 //  stbi__context struct and start_xxx functions
 
+// destination for the stbi_load_rows* functions; loaders that can produce
+// the image in pieces check stbi__context::rows and pass them on with
+// stbi__rows_emit instead of building the whole image
+enum
+{
+   STBI__ROWS_callback,          // stbi_load_rows*: hand the rows to callback
+   STBI__ROWS_dest,              // stbi_load_into*: write them to dest
+   STBI__ROWS_region,            // stbi_load_region*: keep only the rectangle rx0,ry0,rw,rh
+                                 // of the output image, in a dest allocated by the first emit
+   STBI__ROWS_alloc              // stbi_push: allocate dest for the whole image at the first emit
+};
+
+typedef struct
+{
+   int mode;
+   stbi_rows_callback *callback;
+   void *user;
+   int *x, *y, *comp;
+   int req_comp;
+   int flip;
+   stbi__uint32 rows_done;
+   stbi_uc *convert;          // one row, for format conversion
+   stbi_uc *dest;
+   int dest_stride, dest_height;
+   int rx0, ry0, rw, rh;
+   int cropped;               // set by loaders that emit only the region columns
+   stbi__uint32 region_rows;
+} stbi__rows;
+
 // stbi__context structure is our basic context used by all images, so it
 // contains all the IO context, plus some basic image information
 typedef struct
@@ -807,44 +1277,94 @@ typedef struct
    stbi__uint32 img_x, img_y;
    int img_n, img_out_n;
 
+   stbi__rows *rows;          // non-NULL if streaming
+   int flip;                  // flip on load requested; loaders that write the rows
+                              // bottom-up then set stbi__result_info::flipped
+   struct stbi_jpeg_decoder *jpeg; // if set, the file is a JPEG to decode with this
+
    stbi_io_callbacks io;
    void *io_user_data;
+   stbi_uc const *(*io_next)(void *user,int size,int *len); // zero-copy callbacks, instead of io.read
 
    int read_from_callbacks;
    int buflen;
-   stbi_uc buffer_start[128];
+   stbi_uc buffer_start[STBI_IO_BUFFER_SIZE];
    int callback_already_read;
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   void *file_map;            // set if reading a memory-mapped FILE
+   size_t file_map_size;
 } stbi__context;
 
 
 static void stbi__refill_buffer(stbi__context *s);
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+static void stbi__rows_begin(stbi__context *s, int comp);
+#endif
+static int stbi__rows_emit(stbi__context *s, stbi_uc *data, int img_n, int y, int num_rows, int stride);
 
 // initialize a memory-decode context
 static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
+   s->rows = NULL;
+   s->flip = 0;
+   s->jpeg = NULL;
    s->io.read = NULL;
+   s->io_next = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->file_map = NULL;
 }
 
 // initialize a callback-based context
 static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
 {
+   s->rows = NULL;
+   s->flip = 0;
+   s->jpeg = NULL;
    s->io = *c;
    s->io_user_data = user;
+   s->io_next = NULL;
+   s->buflen = sizeof(s->buffer_start);
+   s->read_from_callbacks = 1;
+   s->callback_already_read = 0;
+   s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->img_buffer_end = NULL; // tells stbi__refill_buffer this is the first one
+   s->file_map = NULL;
+   stbi__refill_buffer(s);
+   s->img_buffer_original_end = s->img_buffer_end;
+}
+
+// initialize a context reading through stbi_io_next_callbacks
+static void stbi__start_next_callbacks(stbi__context *s, stbi_io_next_callbacks const *c, void *user)
+{
+   stbi_io_callbacks io = c->io;
+   io.read = NULL;
+   s->io_next = c->next;
+   s->rows = NULL;
+   s->flip = 0;
+   s->jpeg = NULL;
+   s->io = io;
+   s->io_user_data = user;
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->img_buffer_end = NULL;
+   s->file_map = NULL;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
 
+stbi_inline static int stbi__io_callbacks(stbi__context *s)
+{
+   return s->io.read != NULL || s->io_next != NULL;
+}
+
 #ifndef STBI_NO_STDIO
 
 static int stbi__stdio_read(void *user, char *data, int size)
@@ -874,12 +1394,62 @@ static stbi_io_callbacks stbi__stdio_callbacks =
    stbi__stdio_eof,
 };
 
+#ifdef STBI__MMAP
+// map the rest of the file and decode it from memory; returns 0 (so the file
+// gets read normally) for pipes, empty files and anything else mmap won't do
+static int stbi__map_file(stbi__context *s, FILE *f)
+{
+   struct stat st;
+   long pos = ftell(f), start;
+   void *map;
+   if (pos < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode))
+      return 0;
+   if (st.st_size <= pos || st.st_size - pos > INT_MAX)
+      return 0;
+   start = pos & ~(sysconf(_SC_PAGESIZE) - 1); // mmap offsets must be page aligned
+   map = mmap(NULL, (size_t) (st.st_size - start), PROT_READ, MAP_PRIVATE, fileno(f), start);
+   if (map == MAP_FAILED)
+      return 0;
+   stbi__start_mem(s, (stbi_uc *) map + (pos - start), (int) (st.st_size - pos));
+   s->io_user_data = (void *) f;
+   s->file_map = map;
+   s->file_map_size = (size_t) (st.st_size - start);
+   return 1;
+}
+#endif
+
 static void stbi__start_file(stbi__context *s, FILE *f)
 {
+#ifdef STBI__MMAP
+   if (stbi__map_file(s, f))
+      return;
+#endif
    stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
 }
 
-//static void stop_file(stbi__context *s) { }
+// leave the FILE positioned just after what was actually used
+static void stbi__unget_file(stbi__context *s)
+{
+   if (s->file_map) {
+      // the FILE hasn't moved at all
+      stbi_uc *end = s->img_buffer < s->img_buffer_end ? s->img_buffer : s->img_buffer_end;
+      fseek((FILE *) s->io_user_data, (long) (end - s->img_buffer_original), SEEK_CUR);
+   } else {
+      // need to 'unget' all the characters in the IO buffer
+      fseek((FILE *) s->io_user_data, - (int) (s->img_buffer_end - s->img_buffer), SEEK_CUR);
+   }
+}
+
+static void stbi__stop_file(stbi__context *s)
+{
+#ifdef STBI__MMAP
+   if (s->file_map)
+      munmap(s->file_map, s->file_map_size);
+   s->file_map = NULL;
+#else
+   STBI_NOTUSED(s);
+#endif
+}
 
 #endif // !STBI_NO_STDIO
 
@@ -903,6 +1473,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped; // the image is already upside down, as asked for by stbi__context::flip
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -982,9 +1553,136 @@ static int stbi__err(const char *str)
 }
 #endif
 
+#ifdef STBI_PROFILE
+
+#ifndef STBI_PROFILE_FUNC
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#ifdef _MSC_VER
+  STBI_EXTERN unsigned __int64 __rdtsc(void);
+  #define STBI_PROFILE_FUNC() __rdtsc()
+#else
+  static stbi_profile_clocks STBI_PROFILE_FUNC(void)
+  {
+    stbi__uint32 lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((stbi_profile_clocks) hi << 32) | lo;
+  }
+#endif
+
+#elif defined(_M_ARM64) || defined(__aarch64__)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  #define STBI_PROFILE_FUNC() _ReadStatusReg(ARM64_CNTVCT)
+#else
+  static stbi_profile_clocks STBI_PROFILE_FUNC(void)
+  {
+    stbi_profile_clocks t;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+    return t;
+  }
+#endif
+
+#else
+#error "Unknown platform for STBI_PROFILE; define STBI_PROFILE_FUNC() to return a 64-bit clock"
+#endif
+
+#endif
+
+typedef struct
+{
+   stbi_profile_info info;
+   stbi_profile_clocks nested;   // clocks of the zones inside the current one
+   int loads;                    // nesting depth of STBI__PROFILE_LOAD_START
+} stbi__profile;
+
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi__profile stbi__prof;
+
+STBIDEF void stbi_get_profile_info(stbi_profile_info *info)
+{
+   *info = stbi__prof.info;
+}
+
+// a zone adds its clocks to stage 'wh', minus those of the zones inside it,
+// which it then passes on to the zone around it. zones can nest, including
+// in the same stage. they open and close a block, so use them in pairs in
+// the same block, after the declarations; returning from inside one only
+// upsets the counts of that load, which is then failing or stopping early
+#define STBI__PROFILE_START(wh)  { stbi_profile_clocks wh##_clocks = STBI_PROFILE_FUNC(), wh##_outer = stbi__prof.nested; stbi__prof.nested = 0
+#define STBI__PROFILE_END(wh)    wh##_clocks = STBI_PROFILE_FUNC() - wh##_clocks; stbi__prof.info.wh += wh##_clocks - stbi__prof.nested; stbi__prof.nested = wh##_outer + wh##_clocks; }
+
+// around a whole load: clears the counts, unless it is part of another load.
+// nothing may return from inside these
+#define STBI__PROFILE_LOAD_START { stbi_profile_clocks load_clocks; if (stbi__prof.loads++ == 0) { memset(&stbi__prof.info, 0, sizeof(stbi__prof.info)); stbi__prof.nested = 0; } load_clocks = STBI_PROFILE_FUNC()
+#define STBI__PROFILE_LOAD_END   if (--stbi__prof.loads == 0) stbi__prof.info.total = STBI_PROFILE_FUNC() - load_clocks; }
+
+#else
+
+#define STBI__PROFILE_START(wh)
+#define STBI__PROFILE_END(wh)
+#define STBI__PROFILE_LOAD_START
+#define STBI__PROFILE_LOAD_END
+
+#endif
+
+static stbi_allocator const *stbi__allocator_global;
+
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator)
+{
+   stbi__allocator_global = allocator;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__allocator  stbi__allocator_global
+#else
+static STBI_THREAD_LOCAL stbi_allocator const *stbi__allocator_local;
+static STBI_THREAD_LOCAL int stbi__allocator_set;
+
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator)
+{
+   stbi__allocator_local = allocator;
+   stbi__allocator_set = 1;
+}
+
+#define stbi__allocator  (stbi__allocator_set           \
+                          ? stbi__allocator_local       \
+                          : stbi__allocator_global)
+#endif // STBI_THREAD_LOCAL
+
+// all allocations go through these three, so they pick up stbi_set_allocator
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+   stbi_allocator const *a = stbi__allocator;
+   void *p;
+   STBI__PROFILE_START(alloc);
+   p = a ? a->malloc_fn(a->user, size) : STBI_MALLOC(size);
+   STBI__PROFILE_END(alloc);
+   return p;
+}
+
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+   stbi_allocator const *a = stbi__allocator;
+   STBI__PROFILE_START(alloc);
+   if (a) p = a->realloc_fn(a->user, p, oldsz, newsz);
+   else p = STBI_REALLOC_SIZED(p, oldsz, newsz);
+   STBI__PROFILE_END(alloc);
+   STBI_NOTUSED(oldsz);
+   return p;
+}
+
+static void stbi__free(void *p)
+{
+   stbi_allocator const *a = stbi__allocator;
+   STBI__PROFILE_START(alloc);
+   if (a) a->free_fn(a->user, p);
+   else STBI_FREE(p);
+   STBI__PROFILE_END(alloc);
 }
 
 // stb_image uses ints pervasively, including for offset calculations.
@@ -1100,7 +1798,7 @@ static int stbi__mul2shorts_valid(int a, int b)
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
-   STBI_FREE(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_LINEAR
@@ -1134,6 +1832,67 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+// stored as log2 of the scale denominator
+static int stbi__jpeg_downscale_shift(int scale_denominator)
+{
+   return scale_denominator >= 8 ? 3 : scale_denominator >= 4 ? 2 : scale_denominator >= 2 ? 1 : 0;
+}
+
+static int stbi__jpeg_downscale_on_load_global = 0;
+
+STBIDEF void stbi_set_jpeg_downscale_on_load(int scale_denominator)
+{
+   stbi__jpeg_downscale_on_load_global = stbi__jpeg_downscale_shift(scale_denominator);
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__jpeg_downscale_on_load  stbi__jpeg_downscale_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__jpeg_downscale_on_load_local, stbi__jpeg_downscale_on_load_set;
+
+STBIDEF void stbi_set_jpeg_downscale_on_load_thread(int scale_denominator)
+{
+   stbi__jpeg_downscale_on_load_local = stbi__jpeg_downscale_shift(scale_denominator);
+   stbi__jpeg_downscale_on_load_set = 1;
+}
+
+#define stbi__jpeg_downscale_on_load  (stbi__jpeg_downscale_on_load_set       \
+                                        ? stbi__jpeg_downscale_on_load_local  \
+                                        : stbi__jpeg_downscale_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+static stbi_parallel_for *stbi__parallel_for_global;
+static void *stbi__parallel_for_user_global;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *hook, void *hook_user)
+{
+   stbi__parallel_for_global = hook;
+   stbi__parallel_for_user_global = hook_user;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__parallel_for        stbi__parallel_for_global
+#define stbi__parallel_for_user   stbi__parallel_for_user_global
+#else
+static STBI_THREAD_LOCAL stbi_parallel_for *stbi__parallel_for_local;
+static STBI_THREAD_LOCAL void *stbi__parallel_for_user_local;
+static STBI_THREAD_LOCAL int stbi__parallel_for_set;
+
+STBIDEF void stbi_set_parallel_for_thread(stbi_parallel_for *hook, void *hook_user)
+{
+   stbi__parallel_for_local = hook;
+   stbi__parallel_for_user_local = hook_user;
+   stbi__parallel_for_set = 1;
+}
+
+#define stbi__parallel_for        (stbi__parallel_for_set                 \
+                                    ? stbi__parallel_for_local            \
+                                    : stbi__parallel_for_global)
+#define stbi__parallel_for_user   (stbi__parallel_for_set                 \
+                                    ? stbi__parallel_for_user_local       \
+                                    : stbi__parallel_for_user_global)
+#endif // STBI_THREAD_LOCAL
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1141,6 +1900,10 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
    ri->num_channels = 0;
 
+   #ifndef STBI_NO_JPEG
+   if (s->jpeg) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
+   #endif
+
    // test the formats with a very explicit header first (at least a FOURCC
    // or distinctive magic number first)
    #ifndef STBI_NO_PNG
@@ -1196,10 +1959,12 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    reduced = (stbi_uc *) stbi__malloc(img_len);
    if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
 
+   STBI__PROFILE_START(convert);
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
+   STBI__PROFILE_END(convert);
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1212,10 +1977,12 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
    if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
 
+   STBI__PROFILE_START(convert);
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
+   STBI__PROFILE_END(convert);
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
@@ -1260,25 +2027,29 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   void *result;
 
-   if (result == NULL)
-      return NULL;
+   s->flip = stbi__vertically_flip_on_load;
+   STBI__PROFILE_LOAD_START;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
 
-   // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
-   STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
+   if (result != NULL) {
+      // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
+      STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
-   if (ri.bits_per_channel != 8) {
-      result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
-      ri.bits_per_channel = 8;
-   }
+      if (ri.bits_per_channel != 8) {
+         result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+         ri.bits_per_channel = 8;
+      }
 
-   // @TODO: move stbi__convert_format to here
+      // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
-      int channels = req_comp ? req_comp : *comp;
-      stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
+      if (stbi__vertically_flip_on_load && !ri.flipped) {
+         int channels = req_comp ? req_comp : *comp;
+         stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
+      }
    }
+   STBI__PROFILE_LOAD_END;
 
    return (unsigned char *) result;
 }
@@ -1286,26 +2057,30 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   void *result;
 
-   if (result == NULL)
-      return NULL;
+   s->flip = stbi__vertically_flip_on_load;
+   STBI__PROFILE_LOAD_START;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
 
-   // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
-   STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
+   if (result != NULL) {
+      // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
+      STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
-   if (ri.bits_per_channel != 16) {
-      result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
-      ri.bits_per_channel = 16;
-   }
+      if (ri.bits_per_channel != 16) {
+         result = stbi__convert_8_to_16((stbi_uc *) result, *x, *y, req_comp == 0 ? *comp : req_comp);
+         ri.bits_per_channel = 16;
+      }
 
-   // @TODO: move stbi__convert_format16 to here
-   // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
+      // @TODO: move stbi__convert_format16 to here
+      // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
-      int channels = req_comp ? req_comp : *comp;
-      stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
+      if (stbi__vertically_flip_on_load && !ri.flipped) {
+         int channels = req_comp ? req_comp : *comp;
+         stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
+      }
    }
+   STBI__PROFILE_LOAD_END;
 
    return (stbi__uint16 *) result;
 }
@@ -1379,10 +2154,9 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    stbi__context s;
    stbi__start_file(&s,f);
    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
-   if (result) {
-      // need to 'unget' all the characters in the IO buffer
-      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
-   }
+   if (result)
+      stbi__unget_file(&s);
+   stbi__stop_file(&s);
    return result;
 }
 
@@ -1392,10 +2166,9 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
    stbi__context s;
    stbi__start_file(&s,f);
    result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
-   if (result) {
-      // need to 'unget' all the characters in the IO buffer
-      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
-   }
+   if (result)
+      stbi__unget_file(&s);
+   stbi__stop_file(&s);
    return result;
 }
 
@@ -1426,6 +2199,13 @@ STBIDEF stbi_us *stbi_load_16_from_callbacks(stbi_io_callbacks const *clbk, void
    return stbi__load_and_postprocess_16bit(&s,x,y,channels_in_file,desired_channels);
 }
 
+STBIDEF stbi_us *stbi_load_16_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels)
+{
+   stbi__context s;
+   stbi__start_next_callbacks(&s, clbk, user);
+   return stbi__load_and_postprocess_16bit(&s,x,y,channels_in_file,desired_channels);
+}
+
 STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -1440,6 +2220,232 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_next_callbacks(&s, clbk, user);
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+static int stbi__load_rows_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__rows *r)
+{
+   stbi__result_info ri;
+   void *result;
+   int ok;
+
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+
+   r->x = x;
+   r->y = y;
+   r->comp = comp;
+   r->req_comp = req_comp;
+   r->flip = stbi__vertically_flip_on_load;
+
+   // loaders that can stream return NULL, having emitted every row; the
+   // others (or ones that can't stream this particular file) return the
+   // whole image as usual, which we then pass on in one go
+   STBI__PROFILE_LOAD_START;
+   s->rows = r;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   s->rows = NULL;
+
+   if (result) {
+      int channels = req_comp ? req_comp : *comp;
+      if (ri.bits_per_channel != 8)
+         result = stbi__convert_16_to_8((stbi__uint16 *) result, *x, *y, channels);
+      ok = 0;
+      if (result) {
+         s->rows = r;
+         s->img_x = *x;
+         s->img_y = *y;
+         r->cropped = 0;
+         ok = stbi__rows_emit(s, (stbi_uc *) result, channels, 0, *y, *x * channels);
+         s->rows = NULL;
+         stbi__free(result);
+      }
+   } else {
+      ok = r->rows_done != 0 && r->rows_done == s->img_y;
+   }
+   if (r->mode == STBI__ROWS_region)
+      ok = r->dest != NULL && r->region_rows == (stbi__uint32) r->rh;
+
+   stbi__free(r->convert);
+   r->convert = NULL;
+   STBI__PROFILE_LOAD_END;
+   return ok;
+}
+
+static stbi__rows *stbi__rows_callback(stbi__rows *r, stbi_rows_callback *callback, void *user)
+{
+   memset(r, 0, sizeof(*r));
+   r->mode = STBI__ROWS_callback;
+   r->callback = callback;
+   r->user = user;
+   return r;
+}
+
+static stbi__rows *stbi__rows_dest(stbi__rows *r, stbi_uc *out, int out_stride, int out_height)
+{
+   memset(r, 0, sizeof(*r));
+   r->mode = STBI__ROWS_dest;
+   r->dest = out;
+   r->dest_stride = out_stride;
+   r->dest_height = out_height;
+   return r;
+}
+
+static int stbi__load_into_check(int req_comp, stbi_uc *out, int out_stride, int out_height)
+{
+   if (req_comp < 1 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (out == NULL || out_stride <= 0 || out_height <= 0) return stbi__err("bad output", "Output buffer is NULL or empty");
+   return 1;
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *rows, void *rows_user)
+{
+   stbi__context s;
+   stbi__rows r;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,stbi__rows_callback(&r,rows,rows_user));
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *rows, void *rows_user)
+{
+   stbi__context s;
+   stbi__rows r;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,stbi__rows_callback(&r,rows,rows_user));
+}
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride_in_bytes, int out_height)
+{
+   stbi__context s;
+   stbi__rows r;
+   if (!stbi__load_into_check(req_comp,out,out_stride_in_bytes,out_height)) return 0;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,stbi__rows_dest(&r,out,out_stride_in_bytes,out_height));
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride_in_bytes, int out_height)
+{
+   stbi__context s;
+   stbi__rows r;
+   if (!stbi__load_into_check(req_comp,out,out_stride_in_bytes,out_height)) return 0;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,stbi__rows_dest(&r,out,out_stride_in_bytes,out_height));
+}
+
+static stbi__rows *stbi__rows_region_init(stbi__rows *r, int rx, int ry, int rw, int rh)
+{
+   memset(r, 0, sizeof(*r));
+   r->mode = STBI__ROWS_region;
+   r->rx0 = rx;
+   r->ry0 = ry;
+   r->rw = rw;
+   r->rh = rh;
+   return r;
+}
+
+static stbi_uc *stbi__load_region_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__rows *r)
+{
+   if (r->rx0 < 0 || r->ry0 < 0 || r->rw <= 0 || r->rh <= 0) return stbi__errpuc("bad region", "Region is empty or outside the image");
+   if (!stbi__load_rows_main(s,x,y,comp,req_comp,r)) {
+      stbi__free(r->dest);
+      return NULL;
+   }
+   *x = r->rw;
+   *y = r->rh;
+   return r->dest;
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+   stbi__context s;
+   stbi__rows r;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_region_main(&s,x,y,comp,req_comp,stbi__rows_region_init(&r,region_x,region_y,region_w,region_h));
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+   stbi__context s;
+   stbi__rows r;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region_main(&s,x,y,comp,req_comp,stbi__rows_region_init(&r,region_x,region_y,region_w,region_h));
+}
+
+#ifndef STBI_NO_STDIO
+static int stbi__load_rows_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi__rows *r)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_rows_main(&s,x,y,comp,req_comp,r);
+   if (result)
+      stbi__unget_file(&s);
+   stbi__stop_file(&s);
+   return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *rows, void *rows_user)
+{
+   stbi__rows r;
+   return stbi__load_rows_file(f,x,y,comp,req_comp,stbi__rows_callback(&r,rows,rows_user));
+}
+
+STBIDEF int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_rows_callback *rows, void *rows_user)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_rows_from_file(f,x,y,comp,req_comp,rows,rows_user);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride_in_bytes, int out_height)
+{
+   stbi__rows r;
+   if (!stbi__load_into_check(req_comp,out,out_stride_in_bytes,out_height)) return 0;
+   return stbi__load_rows_file(f,x,y,comp,req_comp,stbi__rows_dest(&r,out,out_stride_in_bytes,out_height));
+}
+
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride_in_bytes, int out_height)
+{
+   FILE *f;
+   int result;
+   if (!stbi__load_into_check(req_comp,out,out_stride_in_bytes,out_height)) return 0;
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f,x,y,comp,req_comp,out,out_stride_in_bytes,out_height);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+   stbi_uc *result;
+   stbi__context s;
+   stbi__rows r;
+   stbi__start_file(&s,f);
+   result = stbi__load_region_main(&s,x,y,comp,req_comp,stbi__rows_region_init(&r,region_x,region_y,region_w,region_h));
+   if (result)
+      stbi__unget_file(&s);
+   stbi__stop_file(&s);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int *x, int *y, int *comp, int req_comp, int region_x, int region_y, int region_w, int region_h)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_region_from_file(f,x,y,comp,req_comp,region_x,region_y,region_w,region_h);
+   fclose(f);
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1447,10 +2453,12 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
    stbi__context s;
    stbi__start_mem(&s,buffer,len);
 
+   STBI__PROFILE_LOAD_START;
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
-      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+   if (result && stbi__vertically_flip_on_load) {
+      stbi__vertical_flip_slices( result, *x, *y, *z, req_comp ? req_comp : *comp );
    }
+   STBI__PROFILE_LOAD_END;
 
    return result;
 }
@@ -1460,19 +2468,25 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
 static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *data;
+   float *result;
+   STBI__PROFILE_LOAD_START;
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       stbi__result_info ri;
-      float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
-      if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
-      return hdr_data;
-   }
+      result = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+      if (result)
+         stbi__float_postprocess(result,x,y,comp,req_comp);
+   } else
    #endif
-   data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
-   if (data)
-      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+   {
+      data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+      if (data)
+         result = stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+      else
+         result = stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+   }
+   STBI__PROFILE_LOAD_END;
+   return result;
 }
 
 STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
@@ -1489,6 +2503,13 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
    return stbi__loadf_main(&s,x,y,comp,req_comp);
 }
 
+STBIDEF float *stbi_loadf_from_next_callbacks(stbi_io_next_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_next_callbacks(&s, clbk, user);
+   return stbi__loadf_main(&s,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_STDIO
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
@@ -1502,9 +2523,12 @@ STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int r
 
 STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
+   float *result;
    stbi__context s;
    stbi__start_file(&s,f);
-   return stbi__loadf_main(&s,x,y,comp,req_comp);
+   result = stbi__loadf_main(&s,x,y,comp,req_comp);
+   stbi__stop_file(&s);
+   return result;
 }
 #endif // !STBI_NO_STDIO
 
@@ -1547,6 +2571,7 @@ STBIDEF int stbi_is_hdr_from_file(FILE *f)
    stbi__context s;
    stbi__start_file(&s,f);
    res = stbi__hdr_test(&s);
+   stbi__stop_file(&s);
    fseek(f, pos, SEEK_SET);
    return res;
    #else
@@ -1596,9 +2621,33 @@ enum
 
 static void stbi__refill_buffer(stbi__context *s)
 {
-   int n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
+   int n;
    s->callback_already_read += (int) (s->img_buffer - s->img_buffer_original);
-   if (n == 0) {
+   if (s->io_next) {
+      stbi_uc const *p;
+      if (s->img_buffer_end == NULL) {
+         // the first bytes are where stbi__rewind goes back to after testing
+         // the format, so keep a (full) copy of those that won't go away
+         int len;
+         for (n=0; n < s->buflen; n += len) {
+            p = (s->io_next)(s->io_user_data, s->buflen - n, &len);
+            if (len <= 0) break;
+            memcpy(s->buffer_start + n, p, len);
+         }
+      } else {
+         // otherwise use the data where it is; stbi__rewind goes back to the
+         // start of the current piece, the same as with a refilled buffer
+         p = (s->io_next)(s->io_user_data, INT_MAX, &n);
+         if (n > 0) {
+            s->img_buffer = s->img_buffer_original = (stbi_uc *) p;
+            s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) p + n;
+            return;
+         }
+         s->img_buffer_original = s->buffer_start;
+      }
+   } else
+      n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
+   if (n <= 0) {
       // at end of file, treat same as if from memory, but need to handle case
       // where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
       s->read_from_callbacks = 0;
@@ -1627,7 +2676,7 @@ stbi_inline static stbi_uc stbi__get8(stbi__context *s)
 #else
 stbi_inline static int stbi__at_eof(stbi__context *s)
 {
-   if (s->io.read) {
+   if (stbi__io_callbacks(s)) {
       if (!(s->io.eof)(s->io_user_data)) return 0;
       // if feof() is true, check if buffer = end
       // special case: we've only got the special 0 character at the end
@@ -1648,7 +2697,7 @@ static void stbi__skip(stbi__context *s, int n)
       s->img_buffer = s->img_buffer_end;
       return;
    }
-   if (s->io.read) {
+   if (stbi__io_callbacks(s)) {
       int blen = (int) (s->img_buffer_end - s->img_buffer);
       if (blen < n) {
          s->img_buffer = s->img_buffer_end;
@@ -1665,7 +2714,21 @@ static void stbi__skip(stbi__context *s, int n)
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
 {
-   if (s->io.read) {
+   if (s->io_next) {
+      // copy from as many pieces as it takes; the rest of the last one stays buffered
+      while (n > s->img_buffer_end - s->img_buffer) {
+         int blen = (int) (s->img_buffer_end - s->img_buffer);
+         memcpy(buffer, s->img_buffer, blen);
+         buffer += blen;
+         n -= blen;
+         s->img_buffer = s->img_buffer_end;
+         if (!s->read_from_callbacks)
+            return 0;
+         stbi__refill_buffer(s);
+         if (!s->read_from_callbacks)
+            return 0; // that was just the 0 put in at the end
+      }
+   } else if (s->io.read) {
       int blen = (int) (s->img_buffer_end - s->img_buffer);
       if (blen < n) {
          int res, count;
@@ -1729,9 +2792,6 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 
 #define STBI__BYTECAST(x)  ((stbi_uc) ((x) & 255))  // truncate int to byte without warnings
 
-#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
-// nothing
-#else
 //////////////////////////////////////////////////////////////////////////////
 //
 //  generic converter from built-in img_n to req_comp
@@ -1747,109 +2807,600 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 {
    return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
+
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+
+#ifdef STBI_SSE2
+// four packed RGB pixels spread out to one per 32-bit lane; byte 3 is junk.
+// reads 16 bytes
+static __m128i stbi__sse2_rgb_to_rgbx(stbi_uc const *src)
+{
+   __m128i v = _mm_loadu_si128((__m128i const *) src);
+   __m128i a = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+   __m128i b = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+   return _mm_unpacklo_epi64(a, b);
+}
+
+// the low 12 bytes of four registers, written out as 48 contiguous bytes
+static void stbi__sse2_store_12x4(stbi_uc *dest, __m128i r0, __m128i r1, __m128i r2, __m128i r3)
+{
+   _mm_storeu_si128((__m128i *) (dest +  0), _mm_or_si128(r0, _mm_slli_si128(r1, 12)));
+   _mm_storeu_si128((__m128i *) (dest + 16), _mm_or_si128(_mm_srli_si128(r1, 4), _mm_slli_si128(r2, 8)));
+   _mm_storeu_si128((__m128i *) (dest + 32), _mm_or_si128(_mm_srli_si128(r2, 8), _mm_slli_si128(r3, 4)));
+}
+
+// stbi__compute_y of the pixels in each 32-bit lane, same rounding
+static __m128i stbi__sse2_compute_y4(__m128i px)
+{
+   __m128i m = _mm_set1_epi32(255);
+   __m128i r = _mm_mullo_epi16(_mm_and_si128(px, m), _mm_set1_epi32(77));
+   __m128i g = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(px, 8), m), _mm_set1_epi32(150));
+   __m128i b = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(px, 16), m), _mm_set1_epi32(29));
+   // at most 255*256, so the 16-bit sums can't carry into the zero top half
+   return _mm_srli_epi32(_mm_add_epi16(_mm_add_epi16(r, g), b), 8);
+}
 #endif
 
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// SIMD versions of the common stbi__convert_row cases; returns the number of
+// pixels done, the caller finishes the row. src may be dest when channels
+// are dropped: every block is fully read before it is written
+static int stbi__convert_row_simd(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, int x)
+{
+   int i = 0;
+#ifdef STBI_SSE2
+   if (!stbi__sse2_available()) return 0;
+   switch (STBI__COMBO(img_n, req_comp)) {
+      case STBI__COMBO(1,4): {
+         __m128i alpha = _mm_set1_epi8(-1);
+         for (; i + 16 <= x; i += 16) {
+            __m128i v  = _mm_loadu_si128((__m128i const *) (src + i));
+            __m128i gg0 = _mm_unpacklo_epi8(v, v), ga0 = _mm_unpacklo_epi8(v, alpha);
+            __m128i gg1 = _mm_unpackhi_epi8(v, v), ga1 = _mm_unpackhi_epi8(v, alpha);
+            _mm_storeu_si128((__m128i *) (dest + i*4 +  0), _mm_unpacklo_epi16(gg0, ga0));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpackhi_epi16(gg0, ga0));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 32), _mm_unpacklo_epi16(gg1, ga1));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 48), _mm_unpackhi_epi16(gg1, ga1));
+         }
+      } break;
+      case STBI__COMBO(2,4): {
+         __m128i m = _mm_set1_epi16(255);
+         for (; i + 8 <= x; i += 8) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (src + i*2));
+            __m128i g = _mm_and_si128(v, m);
+            __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+            _mm_storeu_si128((__m128i *) (dest + i*4 +  0), _mm_unpacklo_epi16(gg, v));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpackhi_epi16(gg, v));
+         }
+      } break;
+      case STBI__COMBO(3,4): {
+         __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+         // the last load reads 4 bytes past the 12 it uses
+         for (; i + 6 <= x; i += 4)
+            _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(stbi__sse2_rgb_to_rgbx(src + i*3), alpha));
+      } break;
+      case STBI__COMBO(4,3): {
+         __m128i lo = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+         __m128i hi = _mm_set_epi32(0xffff, (int) 0xff000000, 0xffff, (int) 0xff000000), r[4];
+         int k;
+         for (; i + 16 <= x; i += 16) {
+            for (k=0; k < 4; ++k) {
+               __m128i v = _mm_loadu_si128((__m128i const *) (src + i*4 + k*16));
+               // two RGB pixels packed at the bottom of each 64-bit half...
+               __m128i t = _mm_or_si128(_mm_and_si128(v, lo), _mm_and_si128(_mm_srli_epi64(v, 8), hi));
+               // ...then the halves moved together
+               r[k] = _mm_or_si128(_mm_move_epi64(t), _mm_slli_si128(_mm_srli_si128(t, 8), 6));
+            }
+            stbi__sse2_store_12x4(dest + i*3, r[0], r[1], r[2], r[3]);
+         }
+      } break;
+      case STBI__COMBO(3,1):
+         for (; i + 18 <= x; i += 16) {
+            __m128i y0 = stbi__sse2_compute_y4(stbi__sse2_rgb_to_rgbx(src + i*3 +  0));
+            __m128i y1 = stbi__sse2_compute_y4(stbi__sse2_rgb_to_rgbx(src + i*3 + 12));
+            __m128i y2 = stbi__sse2_compute_y4(stbi__sse2_rgb_to_rgbx(src + i*3 + 24));
+            __m128i y3 = stbi__sse2_compute_y4(stbi__sse2_rgb_to_rgbx(src + i*3 + 36));
+            _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3)));
+         }
+         break;
+      case STBI__COMBO(4,1):
+         for (; i + 16 <= x; i += 16) {
+            __m128i y0 = stbi__sse2_compute_y4(_mm_loadu_si128((__m128i const *) (src + i*4 +  0)));
+            __m128i y1 = stbi__sse2_compute_y4(_mm_loadu_si128((__m128i const *) (src + i*4 + 16)));
+            __m128i y2 = stbi__sse2_compute_y4(_mm_loadu_si128((__m128i const *) (src + i*4 + 32)));
+            __m128i y3 = stbi__sse2_compute_y4(_mm_loadu_si128((__m128i const *) (src + i*4 + 48)));
+            _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3)));
+         }
+         break;
+   }
+#else
+   switch (STBI__COMBO(img_n, req_comp)) {
+      case STBI__COMBO(1,4):
+         for (; i + 16 <= x; i += 16) {
+            uint8x16x4_t o;
+            o.val[0] = o.val[1] = o.val[2] = vld1q_u8(src + i);
+            o.val[3] = vdupq_n_u8(255);
+            vst4q_u8(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(2,4):
+         for (; i + 16 <= x; i += 16) {
+            uint8x16x2_t v = vld2q_u8(src + i*2);
+            uint8x16x4_t o;
+            o.val[0] = o.val[1] = o.val[2] = v.val[0];
+            o.val[3] = v.val[1];
+            vst4q_u8(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(3,4):
+         for (; i + 16 <= x; i += 16) {
+            uint8x16x3_t v = vld3q_u8(src + i*3);
+            uint8x16x4_t o;
+            o.val[0] = v.val[0];
+            o.val[1] = v.val[1];
+            o.val[2] = v.val[2];
+            o.val[3] = vdupq_n_u8(255);
+            vst4q_u8(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(4,3):
+         for (; i + 16 <= x; i += 16) {
+            uint8x16x4_t v = vld4q_u8(src + i*4);
+            uint8x16x3_t o;
+            o.val[0] = v.val[0];
+            o.val[1] = v.val[1];
+            o.val[2] = v.val[2];
+            vst3q_u8(dest + i*3, o);
+         }
+         break;
+      case STBI__COMBO(3,1):
+      case STBI__COMBO(4,1):
+         for (; i + 16 <= x; i += 16) {
+            uint8x16_t r, g, b;
+            uint16x8_t lo, hi;
+            if (img_n == 3) {
+               uint8x16x3_t v = vld3q_u8(src + i*3);
+               r = v.val[0]; g = v.val[1]; b = v.val[2];
+            } else {
+               uint8x16x4_t v = vld4q_u8(src + i*4);
+               r = v.val[0]; g = v.val[1]; b = v.val[2];
+            }
+            lo = vmull_u8(vget_low_u8(r), vdup_n_u8(77));
+            lo = vmlal_u8(lo, vget_low_u8(g), vdup_n_u8(150));
+            lo = vmlal_u8(lo, vget_low_u8(b), vdup_n_u8(29));
+            hi = vmull_u8(vget_high_u8(r), vdup_n_u8(77));
+            hi = vmlal_u8(hi, vget_high_u8(g), vdup_n_u8(150));
+            hi = vmlal_u8(hi, vget_high_u8(b), vdup_n_u8(29));
+            vst1q_u8(dest + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+         }
+         break;
+   }
+#endif
+   return i;
+}
+#endif
+
+// convert one scanline; returns 0 for an unsupported combination
+static int stbi__convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   STBI__PROFILE_START(convert);
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+   i = stbi__convert_row_simd(dest, src, img_n, req_comp, (int) x);
+   src  += i * img_n;
+   dest += i * req_comp;
+   x    -= i;
+#endif
+
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: return 0;
+   }
+   #undef STBI__CASE
+   STBI__PROFILE_END(convert);
+   return 1;
+}
+
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
-   if (good == NULL) {
-      STBI_FREE(data);
-      return stbi__errpuc("outofmem", "Out of memory");
+   // dropping channels never writes ahead of what it reads, so do it in place
+   if (req_comp < img_n)
+      good = data;
+   else {
+      good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
+      if (good == NULL) {
+         stbi__free(data);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+      if (!stbi__convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         STBI_ASSERT(0); stbi__free(data); if (good != data) stbi__free(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
+   }
+
+   if (good == data) {
+      // hand back the unused tail; if that fails the bigger block is still fine
+      if (x && y) good = (unsigned char *) stbi__realloc_sized(data, (size_t) img_n * x * y, (size_t) req_comp * x * y);
+      return good ? good : data;
+   }
+   stbi__free(data);
    return good;
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
-// nothing
-#else
-static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// for loaders that don't have the output pointers at hand: report the
+// image size before the first stbi__rows_emit
+static void stbi__rows_begin(stbi__context *s, int comp)
+{
+   *s->rows->x = s->img_x;
+   *s->rows->y = s->img_y;
+   if (s->rows->comp) *s->rows->comp = comp;
+}
+#endif
+
+// clip the stbi_load_region* rectangle to the image, once its size is known
+static int stbi__rows_region(stbi__context *s)
+{
+   stbi__rows *r = s->rows;
+   if ((stbi__uint32) r->rx0 >= s->img_x || (stbi__uint32) r->ry0 >= s->img_y)
+      return stbi__err("bad region", "Region is outside the image");
+   if ((stbi__uint32) r->rw > s->img_x - r->rx0) r->rw = s->img_x - r->rx0;
+   if ((stbi__uint32) r->rh > s->img_y - r->ry0) r->rh = s->img_y - r->ry0;
+   return 1;
+}
+
+// hand num_rows scanlines of img_n-channel pixels, starting at row y (in
+// file order, i.e. before any flip), to the stbi_load_rows* callback
+static int stbi__rows_emit(stbi__context *s, stbi_uc *data, int img_n, int y, int num_rows, int stride)
+{
+   stbi__rows *r = s->rows;
+   int out_n = r->req_comp ? r->req_comp : img_n;
+   int x0 = 0, w = s->img_x;
+   int i;
+
+   if (r->mode == STBI__ROWS_region) {
+      if (r->dest == NULL) {
+         if (!stbi__rows_region(s)) return 0;
+         r->dest = (stbi_uc *) stbi__malloc_mad3(r->rw, r->rh, out_n, 0);
+         if (r->dest == NULL) return stbi__err("outofmem", "Out of memory");
+         r->dest_stride = r->rw * out_n;
+      }
+      if (!r->cropped) x0 = r->rx0 * img_n;
+      w = r->rw;
+   } else if (r->mode == STBI__ROWS_alloc) {
+      if (r->dest == NULL) {
+         r->dest = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_n, 0);
+         if (r->dest == NULL) return stbi__err("outofmem", "Out of memory");
+         r->dest_stride = s->img_x * out_n;
+         r->dest_height = s->img_y;
+      }
+   } else if (r->mode == STBI__ROWS_dest) {
+      if (r->dest == NULL || r->dest_stride <= 0 || r->dest_height <= 0 || (stbi__uint32) r->dest_stride < s->img_x * out_n || s->img_y > (stbi__uint32) r->dest_height)
+         return stbi__err("too large", "Image doesn't fit the output buffer");
+   }
+
+   if (r->mode != STBI__ROWS_callback) {
+      for (i=0; i < num_rows; ++i) {
+         stbi_uc *row = data + i*stride + x0;
+         int oy = r->flip ? (int) s->img_y-1 - (y+i) : y+i;
+         stbi_uc *dest;
+         if (r->mode == STBI__ROWS_region) {
+            if (oy < r->ry0 || oy >= r->ry0 + r->rh) continue;
+            oy -= r->ry0;
+            ++r->region_rows;
+         }
+         dest = r->dest + (size_t) r->dest_stride * oy;
+         if (out_n == img_n)
+            memcpy(dest, row, w * out_n);
+         else if (!stbi__convert_row(dest, row, img_n, out_n, w))
+            return stbi__err("unsupported", "Unsupported format conversion");
+      }
+      // with the whole region in hand, fail without an error so the loader
+      // stops reading; stbi__load_rows_main counts that as success
+      if (r->mode == STBI__ROWS_region && r->region_rows == (stbi__uint32) r->rh)
+         return 0;
+   } else if (out_n == img_n && !r->flip) {
+      if (!r->callback(r->user, data, stride, y, num_rows))
+         return stbi__err("callback abort", "Row callback stopped decoding");
+   } else {
+      if (out_n != img_n && r->convert == NULL) {
+         r->convert = (stbi_uc *) stbi__malloc_mad3(s->img_x, out_n, 1, 0);
+         if (r->convert == NULL) return stbi__err("outofmem", "Out of memory");
+      }
+      for (i=0; i < num_rows; ++i) {
+         stbi_uc *row = data + i*stride;
+         if (out_n != img_n) {
+            if (!stbi__convert_row(r->convert, row, img_n, out_n, s->img_x))
+               return stbi__err("unsupported", "Unsupported format conversion");
+            row = r->convert;
+         }
+         if (!r->callback(r->user, row, s->img_x * out_n, r->flip ? (int) s->img_y-1 - (y+i) : y+i, 1))
+            return stbi__err("callback abort", "Row callback stopped decoding");
+      }
+   }
+   r->rows_done += num_rows;
+   return 1;
+}
+
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+// nothing
+#else
+static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
+{
+   return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
+}
+#endif
+
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+// nothing
+#else
+#ifdef STBI_SSE2
+// two packed 16-bit RGB pixels spread out to one per 64-bit half; the last
+// channel is junk. reads 16 bytes
+static __m128i stbi__sse2_rgb16_to_rgbx(stbi__uint16 const *src)
+{
+   __m128i v = _mm_loadu_si128((__m128i const *) src);
+   return _mm_unpacklo_epi64(v, _mm_srli_si128(v, 6));
+}
+
+// the RGB of the pixel in each 64-bit half, packed into the low 12 bytes
+static __m128i stbi__sse2_rgbx16_to_rgb(__m128i px)
+{
+   __m128i t = _mm_and_si128(px, _mm_srli_epi64(_mm_set1_epi32(-1), 16));
+   return _mm_or_si128(_mm_move_epi64(t), _mm_slli_si128(_mm_srli_si128(t, 8), 6));
+}
+
+// stbi__compute_y_16 of the pixels in each 64-bit half of p01 and p23, same
+// rounding, one per 32-bit lane
+static __m128i stbi__sse2_compute_y4_16(__m128i p01, __m128i p23)
+{
+   __m128i coef = _mm_set_epi16(0,29,150,77, 0,29,150,77);
+   __m128i y[2];
+   int k;
+   for (k=0; k < 2; ++k) {
+      __m128i p = k ? p23 : p01;
+      __m128i lo = _mm_mullo_epi16(p, coef), hi = _mm_mulhi_epu16(p, coef);
+      __m128i a = _mm_unpacklo_epi16(lo, hi), b = _mm_unpackhi_epi16(lo, hi);
+      __m128i t = _mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+      t = _mm_add_epi32(t, _mm_srli_epi64(t, 32));
+      y[k] = _mm_shuffle_epi32(_mm_srli_epi32(t, 8), _MM_SHUFFLE(3,1,2,0));
+   }
+   return _mm_unpacklo_epi64(y[0], y[1]);
+}
+
+// eight 16-bit values from 32-bit lanes that hold at most 0xffff
+static __m128i stbi__sse2_pack_u16(__m128i a, __m128i b)
+{
+   // no unsigned pack in SSE2; sign-extend so the signed one keeps the bits
+   a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+   b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+   return _mm_packs_epi32(a, b);
+}
+#endif
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// same as stbi__convert_row_simd, for 16-bit channels
+static int stbi__convert_row16_simd(stbi__uint16 *dest, stbi__uint16 const *src, int img_n, int req_comp, int x)
+{
+   int i = 0;
+#ifdef STBI_SSE2
+   if (!stbi__sse2_available()) return 0;
+   switch (STBI__COMBO(img_n, req_comp)) {
+      case STBI__COMBO(1,4): {
+         __m128i alpha = _mm_set1_epi16(-1);
+         for (; i + 8 <= x; i += 8) {
+            __m128i v  = _mm_loadu_si128((__m128i const *) (src + i));
+            __m128i gg0 = _mm_unpacklo_epi16(v, v), ga0 = _mm_unpacklo_epi16(v, alpha);
+            __m128i gg1 = _mm_unpackhi_epi16(v, v), ga1 = _mm_unpackhi_epi16(v, alpha);
+            _mm_storeu_si128((__m128i *) (dest + i*4 +  0), _mm_unpacklo_epi32(gg0, ga0));
+            _mm_storeu_si128((__m128i *) (dest + i*4 +  8), _mm_unpackhi_epi32(gg0, ga0));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 16), _mm_unpacklo_epi32(gg1, ga1));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 24), _mm_unpackhi_epi32(gg1, ga1));
+         }
+      } break;
+      case STBI__COMBO(2,4): {
+         __m128i m = _mm_set1_epi32(0xffff);
+         for (; i + 4 <= x; i += 4) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (src + i*2));
+            __m128i g = _mm_and_si128(v, m);
+            __m128i gg = _mm_or_si128(g, _mm_slli_epi32(g, 16));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 0), _mm_unpacklo_epi32(gg, v));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 8), _mm_unpackhi_epi32(gg, v));
+         }
+      } break;
+      case STBI__COMBO(3,4): {
+         __m128i alpha = _mm_slli_epi64(_mm_set1_epi32(-1), 48);
+         // the last load reads 4 bytes past the 12 it uses
+         for (; i + 5 <= x; i += 4) {
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 0), _mm_or_si128(stbi__sse2_rgb16_to_rgbx(src + i*3 + 0), alpha));
+            _mm_storeu_si128((__m128i *) (dest + i*4 + 8), _mm_or_si128(stbi__sse2_rgb16_to_rgbx(src + i*3 + 6), alpha));
+         }
+      } break;
+      case STBI__COMBO(4,3):
+         for (; i + 8 <= x; i += 8) {
+            __m128i r0 = stbi__sse2_rgbx16_to_rgb(_mm_loadu_si128((__m128i const *) (src + i*4 +  0)));
+            __m128i r1 = stbi__sse2_rgbx16_to_rgb(_mm_loadu_si128((__m128i const *) (src + i*4 +  8)));
+            __m128i r2 = stbi__sse2_rgbx16_to_rgb(_mm_loadu_si128((__m128i const *) (src + i*4 + 16)));
+            __m128i r3 = stbi__sse2_rgbx16_to_rgb(_mm_loadu_si128((__m128i const *) (src + i*4 + 24)));
+            stbi__sse2_store_12x4((stbi_uc *) (dest + i*3), r0, r1, r2, r3);
+         }
+         break;
+      case STBI__COMBO(3,1):
+         for (; i + 9 <= x; i += 8) {
+            __m128i y0 = stbi__sse2_compute_y4_16(stbi__sse2_rgb16_to_rgbx(src + i*3 +  0), stbi__sse2_rgb16_to_rgbx(src + i*3 +  6));
+            __m128i y1 = stbi__sse2_compute_y4_16(stbi__sse2_rgb16_to_rgbx(src + i*3 + 12), stbi__sse2_rgb16_to_rgbx(src + i*3 + 18));
+            _mm_storeu_si128((__m128i *) (dest + i), stbi__sse2_pack_u16(y0, y1));
+         }
+         break;
+      case STBI__COMBO(4,1):
+         for (; i + 8 <= x; i += 8) {
+            __m128i y0 = stbi__sse2_compute_y4_16(_mm_loadu_si128((__m128i const *) (src + i*4 +  0)), _mm_loadu_si128((__m128i const *) (src + i*4 +  8)));
+            __m128i y1 = stbi__sse2_compute_y4_16(_mm_loadu_si128((__m128i const *) (src + i*4 + 16)), _mm_loadu_si128((__m128i const *) (src + i*4 + 24)));
+            _mm_storeu_si128((__m128i *) (dest + i), stbi__sse2_pack_u16(y0, y1));
+         }
+         break;
+   }
+#else
+   switch (STBI__COMBO(img_n, req_comp)) {
+      case STBI__COMBO(1,4):
+         for (; i + 8 <= x; i += 8) {
+            uint16x8x4_t o;
+            o.val[0] = o.val[1] = o.val[2] = vld1q_u16(src + i);
+            o.val[3] = vdupq_n_u16(0xffff);
+            vst4q_u16(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(2,4):
+         for (; i + 8 <= x; i += 8) {
+            uint16x8x2_t v = vld2q_u16(src + i*2);
+            uint16x8x4_t o;
+            o.val[0] = o.val[1] = o.val[2] = v.val[0];
+            o.val[3] = v.val[1];
+            vst4q_u16(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(3,4):
+         for (; i + 8 <= x; i += 8) {
+            uint16x8x3_t v = vld3q_u16(src + i*3);
+            uint16x8x4_t o;
+            o.val[0] = v.val[0];
+            o.val[1] = v.val[1];
+            o.val[2] = v.val[2];
+            o.val[3] = vdupq_n_u16(0xffff);
+            vst4q_u16(dest + i*4, o);
+         }
+         break;
+      case STBI__COMBO(4,3):
+         for (; i + 8 <= x; i += 8) {
+            uint16x8x4_t v = vld4q_u16(src + i*4);
+            uint16x8x3_t o;
+            o.val[0] = v.val[0];
+            o.val[1] = v.val[1];
+            o.val[2] = v.val[2];
+            vst3q_u16(dest + i*3, o);
+         }
+         break;
+      case STBI__COMBO(3,1):
+      case STBI__COMBO(4,1):
+         for (; i + 8 <= x; i += 8) {
+            uint16x8_t r, g, b;
+            uint32x4_t lo, hi;
+            if (img_n == 3) {
+               uint16x8x3_t v = vld3q_u16(src + i*3);
+               r = v.val[0]; g = v.val[1]; b = v.val[2];
+            } else {
+               uint16x8x4_t v = vld4q_u16(src + i*4);
+               r = v.val[0]; g = v.val[1]; b = v.val[2];
+            }
+            lo = vmull_n_u16(vget_low_u16(r), 77);
+            lo = vmlal_n_u16(lo, vget_low_u16(g), 150);
+            lo = vmlal_n_u16(lo, vget_low_u16(b), 29);
+            hi = vmull_n_u16(vget_high_u16(r), 77);
+            hi = vmlal_n_u16(hi, vget_high_u16(g), 150);
+            hi = vmlal_n_u16(hi, vget_high_u16(b), 29);
+            vst1q_u16(dest + i, vcombine_u16(vshrn_n_u32(lo, 8), vshrn_n_u32(hi, 8)));
+         }
+         break;
+   }
+#endif
+   return i;
+}
+#endif
+
+// convert one scanline; returns 0 for an unsupported combination
+static int stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 const *src, int img_n, int req_comp, unsigned int x)
 {
-   return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
-}
+   int i;
+   STBI__PROFILE_START(convert);
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+   i = stbi__convert_row16_simd(dest, src, img_n, req_comp, (int) x);
+   src  += i * img_n;
+   dest += i * req_comp;
+   x    -= i;
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
-// nothing
-#else
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: return 0;
+   }
+   #undef STBI__CASE
+   STBI__PROFILE_END(convert);
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
-   good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
-   if (good == NULL) {
-      STBI_FREE(data);
-      return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+   // in place when dropping channels, as in stbi__convert_format
+   if (req_comp < img_n)
+      good = data;
+   else {
+      good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
+      if (good == NULL) {
+         stbi__free(data);
+         return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
+      }
    }
 
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+      if (!stbi__convert_row16(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         STBI_ASSERT(0); stbi__free(data); if (good != data) stbi__free(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
+   }
+
+   if (good == data) {
+      if (x && y) good = (stbi__uint16 *) stbi__realloc_sized(data, (size_t) img_n * x * y * 2, (size_t) req_comp * x * y * 2);
+      return good ? good : data;
+   }
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1859,14 +3410,19 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
    float *output;
+   float table[256];
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   STBI__PROFILE_START(convert);
+   // there are only 256 possible inputs, so do the pow()s once
+   for (i=0; i < 256; ++i)
+      table[i] = (float) (pow(i/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+         output[i*comp + k] = table[data[i*comp+k]];
       }
    }
    if (n < comp) {
@@ -1874,28 +3430,111 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
          output[i*comp + n] = data[i*comp + n]/255.0f;
       }
    }
-   STBI_FREE(data);
+   STBI__PROFILE_END(convert);
+   stbi__free(data);
    return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
+static float stbi__bits_to_float(stbi__uint32 bits)
+{
+   float f;
+   memcpy(&f, &bits, sizeof(f));
+   return f;
+}
+
+static stbi_uc stbi__hdr_to_ldr_value(float x)
+{
+   float z = (float) pow(x*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return (stbi_uc) stbi__float2int(z);
+}
+
+// as long as gamma and scale are positive, stbi__hdr_to_ldr_value only goes
+// up with x. so rather than calling pow() for every channel of every pixel,
+// find the smallest x giving each of the outputs 1..255 once, and compare
+// against those; the results are exactly the same
+static void stbi__hdr_to_ldr_thresholds(float *t)
+{
+   stbi__uint32 lo = 0, hi, mid;
+   int v;
+   t[0] = 0;
+   for (v=1; v < 256; ++v) {
+      // non-negative floats sort the same as their bit patterns
+      hi = 0x7f800000; // +inf, which always gives 255
+      while (lo < hi) {
+         mid = lo + ((hi - lo) >> 1);
+         if (stbi__hdr_to_ldr_value(stbi__bits_to_float(mid)) >= v)
+            hi = mid;
+         else
+            lo = mid + 1;
+      }
+      t[v] = stbi__bits_to_float(lo);
+   }
+}
+
+// the thresholds are then bucketed by the top 16 bits of the float; each
+// bucket starts from the output for its smallest value, and rarely needs to
+// step up more than once
+typedef struct
+{
+   float t[257];
+   stbi_uc start[0x7f81];
+} stbi__hdr_to_ldr_table;
+
+static void stbi__hdr_to_ldr_buckets(stbi__hdr_to_ldr_table *tab)
+{
+   stbi__uint32 b;
+   int v = 0;
+   tab->t[256] = stbi__bits_to_float(0x7f800001); // NaN, so never stepped past
+   for (b=0; b < 0x7f81; ++b) {
+      float x = stbi__bits_to_float(b << 16);
+      while (x >= tab->t[v+1]) ++v;
+      tab->start[b] = (stbi_uc) v;
+   }
+}
+
+static stbi_inline stbi_uc stbi__hdr_to_ldr_lookup(stbi__hdr_to_ldr_table const *tab, float x)
+{
+   stbi__uint32 bits;
+   int v;
+   memcpy(&bits, &x, sizeof(bits));
+   if (bits > 0x7f800000) return 0; // NaNs and negative values, as with pow()
+   v = tab->start[bits >> 16];
+   while (x >= tab->t[v+1]) ++v;
+   return (stbi_uc) v;
+}
+
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output;
+   stbi__hdr_to_ldr_table *table = NULL;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   STBI__PROFILE_START(convert);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
+   // building the table takes a few thousand pow()s, so skip it for tiny
+   // images; if it can't be allocated, just do it the slow way
+   if (stbi__h2l_gamma_i > 0 && stbi__h2l_scale_i > 0 && stbi__h2l_scale_i * 0 == 0 && x*y*n > 8192) {
+      table = (stbi__hdr_to_ldr_table *) stbi__malloc(sizeof(*table));
+      if (table) {
+         stbi__hdr_to_ldr_thresholds(table->t);
+         stbi__hdr_to_ldr_buckets(table);
+      }
+   }
    for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
+      if (table) {
+         for (k=0; k < n; ++k)
+            output[i*comp + k] = stbi__hdr_to_ldr_lookup(table, data[i*comp+k]);
+      } else {
+         for (k=0; k < n; ++k)
+            output[i*comp + k] = stbi__hdr_to_ldr_value(data[i*comp+k]);
       }
       if (k < comp) {
          float z = data[i*comp+k] * 255 + 0.5f;
@@ -1904,7 +3543,9 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   STBI__PROFILE_END(convert);
+   stbi__free(table);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1946,6 +3587,34 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } stbi__huffman;
 
+typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
+                                    int w, int hs);
+
+typedef struct
+{
+   resample_row_func resample;
+   stbi_uc *line0,*line1;
+   int hs,vs;   // expansion factor in each axis
+   int x_lores; // first horizontal pixel used pre-expansion (region loads)
+   int w_lores; // horizontal pixels pre-expansion
+   int h_lores; // vertical pixels pre-expansion
+   int ystep;   // how far through vertical expansion we are
+   int ypos;    // which pre-expansion row we're on
+} stbi__resample;
+
+// the entropy decoder state, and where it is, at the start of an iMCU row
+typedef struct
+{
+   int row;
+   int pos;             // offset of the next byte of input
+   stbi__uint32 code_buffer;
+   int code_bits;
+   unsigned char marker;
+   int nomore;
+   int todo, eob_run;
+   int dc_pred[4];
+} stbi__jpeg_mark;
+
 typedef struct
 {
    stbi__context *s;
@@ -1970,10 +3639,14 @@ typedef struct
 
       int x,y,w2,h2;
       stbi_uc *data;
-      void *raw_data, *raw_coeff;
+      void *raw_data;
       stbi_uc *linebuf;
-      short   *coeff;   // progressive only
+      size_t raw_size, linebuf_size; // kept by stbi__jpeg_buffer
+      void   **raw_coeff;   // progressive only: one allocation per band, see stbi__jpeg_coeff
+      short  **coeff;       // the same, aligned
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      int      coeff_band_h;     // block rows per band
+      int roi_bx0, roi_bx1, roi_by0, roi_by1; // blocks needed, see stbi__jpeg::roi
    } img_comp[4];
 
    stbi__uint32   code_buffer; // jpeg entropy-coded buffer
@@ -1993,6 +3666,50 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int coeff_bands;  // progressive: number of bands of STBI__JPEG_FINISH_BAND iMCU rows
+   int idct_size;  // output pixels per block side: 8, or 4/2/1 when downscaling in the DCT domain
+
+// resampling and color conversion into output rows
+   stbi__resample res_comp[4];
+   int out_n, decode_n, is_rgb;
+   stbi__uint32 out_y;  // next output row
+
+// streaming (stbi__context::rows): the component planes only hold the last
+// two iMCU rows, and output rows are passed on as soon as they're complete
+   int stream;
+   int req_comp;
+   stbi_uc *band;       // output rows waiting to be passed on
+
+// planar output (stbi_jpeg_load_planes): full-size planes in one block, which
+// img_comp[0].raw_data owns; nothing is resampled or converted
+   int planar;
+
+// grey output from YCbCr: chroma is entropy-decoded (it has to be, to find
+// the luma), but has no planes and is never transformed
+   int luma_only;
+
+// region loads (STBI__ROWS_region) while streaming: only output columns
+// out_x0..out_x1 are computed, from the blocks in the roi_* range of each
+// component, only rows roi_y0..roi_y1 (in file order) are converted, and
+// restart intervals without any of those blocks are not even entropy-decoded
+   int roi;
+   int out_x0, out_x1;
+   stbi__uint32 roi_y0, roi_y1;
+
+// reusable decoders (stbi_jpeg_decoder): the planes, line buffers and band
+// survive stbi__cleanup_jpeg, to be reused by the next image if big enough
+   struct stbi_jpeg_decoder *keep;
+   size_t band_size;
+
+// resumable decoding (stbi_push) while streaming: stbi__decode_jpeg_image
+// stops at the first scan, and stbi__parse_entropy_coded_data decodes it a
+// few iMCU rows at a time from 'mark'. a row that reaches the end of the
+// input while more is to come is decoded again, from the mark, later
+   int push;
+   int push_more;        // more input is still to come
+   int push_budget;      // output pixels left in this step
+   int push_paused;      // the step stopped at the mark, with rows to go
+   stbi__jpeg_mark mark; // mark.row is -1 until the scan starts
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2000,6 +3717,26 @@ typedef struct
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
+struct stbi_jpeg_decoder
+{
+   stbi__jpeg j;
+   // the DHT data each of huff_dc[0..3], huff_ac[0..3] was built from:
+   // the 16 code counts, then dht_n[] values (dht_n is -1 if not built)
+   stbi_uc dht[8][16+256];
+   int dht_n[8];
+};
+
+// (re)allocate one of the buffers a reusable decoder keeps, unless the one
+// it has is big enough already
+static void *stbi__jpeg_buffer(stbi__jpeg *z, void *p, size_t *kept, size_t size)
+{
+   if (z->keep && p && *kept >= size) return p;
+   stbi__free(p);
+   p = stbi__malloc(size);
+   *kept = p ? size : 0;
+   return p;
+}
+
 static int stbi__build_huffman(stbi__huffman *h, int *count)
 {
    int i,j,k=0;
@@ -2523,53 +4260,308 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
-#ifdef STBI_SSE2
-// sse2 integer IDCT. not the fastest possible implementation but it
-// produces bit-identical results to the generic C version so it's
-// fully "transparent".
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+// reduced-size IDCTs for decoding at 1/2, 1/4 and 1/8 scale, derived from
+// jidctred: they compute an NxN output block directly from the low-frequency
+// coefficients, so the full-resolution block is never generated. same
+// 12-bit fixed-point constants as above; the first pass keeps 2 extra bits.
+#define stbi__descale(x,n)  (((x) + (1 << ((n)-1))) >> (n))
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[32],*v=val;
+   short *d = data;
+
+   // columns; column 4 isn't needed by the row pass
+   for (i=0; i < 8; ++i,++d,++v) {
+      int t0,t2,t10,t12;
+      if (i == 4) continue;
+      if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[40]==0 && d[48]==0 && d[56]==0) {
+         v[0] = v[8] = v[16] = v[24] = d[0]*4;
+         continue;
+      }
+      t0  = d[0] * 8192;
+      t2  = d[16]*stbi__f2f(1.847759065f) - d[48]*stbi__f2f(0.765366865f);
+      t10 = t0 + t2;
+      t12 = t0 - t2;
+      t0  = d[56]*stbi__f2f(-0.211164243f) + d[40]*stbi__f2f( 1.451774981f)
+          + d[24]*stbi__f2f(-2.172734803f) + d[ 8]*stbi__f2f( 1.061594337f);
+      t2  = d[56]*stbi__f2f(-0.509795579f) + d[40]*stbi__f2f(-0.601344887f)
+          + d[24]*stbi__f2f( 0.899976223f) + d[ 8]*stbi__f2f( 2.562915447f);
+      v[ 0] = stbi__descale(t10 + t2, 11);
+      v[24] = stbi__descale(t10 - t2, 11);
+      v[ 8] = stbi__descale(t12 + t0, 11);
+      v[16] = stbi__descale(t12 - t0, 11);
+   }
+
+   for (i=0, v=val; i < 4; ++i,v+=8,out+=out_stride) {
+      int t0,t2,t10,t12;
+      t0  = v[0] * 8192;
+      t2  = v[2]*stbi__f2f(1.847759065f) - v[6]*stbi__f2f(0.765366865f);
+      t10 = t0 + t2;
+      t12 = t0 - t2;
+      t0  = v[7]*stbi__f2f(-0.211164243f) + v[5]*stbi__f2f( 1.451774981f)
+          + v[3]*stbi__f2f(-2.172734803f) + v[1]*stbi__f2f( 1.061594337f);
+      t2  = v[7]*stbi__f2f(-0.509795579f) + v[5]*stbi__f2f(-0.601344887f)
+          + v[3]*stbi__f2f( 0.899976223f) + v[1]*stbi__f2f( 2.562915447f);
+      // 13 bits of fixed point, 2 from the column pass, 3 from the 2D scale
+      out[0] = stbi__clamp(stbi__descale(t10 + t2, 18) + 128);
+      out[3] = stbi__clamp(stbi__descale(t10 - t2, 18) + 128);
+      out[1] = stbi__clamp(stbi__descale(t12 + t0, 18) + 128);
+      out[2] = stbi__clamp(stbi__descale(t12 - t0, 18) + 128);
+   }
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   short *d = data;
+
+   // columns; only the odd ones (and 0) are needed by the row pass
+   for (i=0; i < 8; ++i,++d,++v) {
+      int t0,t10;
+      if (i == 2 || i == 4 || i == 6) continue;
+      if (d[8]==0 && d[24]==0 && d[40]==0 && d[56]==0) {
+         v[0] = v[8] = d[0]*4;
+         continue;
+      }
+      t10 = d[0] * 16384;
+      t0  = d[56]*stbi__f2f(-0.720959822f) + d[40]*stbi__f2f( 0.850430095f)
+          + d[24]*stbi__f2f(-1.272758580f) + d[ 8]*stbi__f2f( 3.624509785f);
+      v[0] = stbi__descale(t10 + t0, 12);
+      v[8] = stbi__descale(t10 - t0, 12);
+   }
+
+   for (i=0, v=val; i < 2; ++i,v+=8,out+=out_stride) {
+      int t0,t10;
+      t10 = v[0] * 16384;
+      t0  = v[7]*stbi__f2f(-0.720959822f) + v[5]*stbi__f2f( 0.850430095f)
+          + v[3]*stbi__f2f(-1.272758580f) + v[1]*stbi__f2f( 3.624509785f);
+      out[0] = stbi__clamp(stbi__descale(t10 + t0, 19) + 128);
+      out[1] = stbi__clamp(stbi__descale(t10 - t0, 19) + 128);
+   }
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   // just the DC term, which is 8x the block average
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(stbi__descale(data[0], 3) + 128);
+}
+
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// avx2 integer IDCT. same structure as the sse2 version above (and so
+// bit-identical to the generic C version), but all the 32-bit intermediate
+// math runs 8 wide, so each 32-bit step is a single instruction.
+static void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
 {
-   // This is constructed to match our regular (generic) integer IDCT exactly.
    __m128i row0, row1, row2, row3, row4, row5, row6, row7;
    __m128i tmp;
 
    // dot product constant: even elems=x, odd elems=y
-   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
    // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
    // out(1) = c1[even]*x + c1[odd]*y
    #define dct_rot(out0,out1, x,y,c0,c1) \
-      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
-      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
-      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
-      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
-      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
-      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
 
    // out = in << 12  (in 16-bit, out 32-bit)
    #define dct_widen(out, in) \
-      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
-      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
-
-   // wide add
-   #define dct_wadd(out, a, b) \
-      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
-
-   // wide sub
-   #define dct_wsub(out, a, b) \
-      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
 
    // butterfly a/b, add bias, then shift by "s" and pack
    #define dct_bfly32o(out0, out1, a,b,bias,s) \
       { \
-         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
-         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
-         dct_wadd(sum, abiased, b); \
-         dct_wsub(dif, abiased, b); \
-         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
-         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+         /* packs works per 128-bit lane; reorder to sum0-7, dif0-7 */ \
+         __m256i sd = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, dif), 0xd8); \
+         out0 = _mm256_castsi256_si128(sd); \
+         out1 = _mm256_extracti128_si256(sd, 1); \
       }
 
    // 8-bit interleave step (for transposes)
@@ -2592,38 +4584,38 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          __m128i dif04 = _mm_sub_epi16(row0, row4); \
          dct_widen(t0e, sum04); \
          dct_widen(t1e, dif04); \
-         dct_wadd(x0, t0e, t3e); \
-         dct_wsub(x3, t0e, t3e); \
-         dct_wadd(x1, t1e, t2e); \
-         dct_wsub(x2, t1e, t2e); \
+         __m256i x0 = _mm256_add_epi32(t0e, t3e); \
+         __m256i x3 = _mm256_sub_epi32(t0e, t3e); \
+         __m256i x1 = _mm256_add_epi32(t1e, t2e); \
+         __m256i x2 = _mm256_sub_epi32(t1e, t2e); \
          /* odd part */ \
          dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
          dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
          __m128i sum17 = _mm_add_epi16(row1, row7); \
          __m128i sum35 = _mm_add_epi16(row3, row5); \
          dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
-         dct_wadd(x4, y0o, y4o); \
-         dct_wadd(x5, y1o, y5o); \
-         dct_wadd(x6, y2o, y5o); \
-         dct_wadd(x7, y3o, y4o); \
+         __m256i x4 = _mm256_add_epi32(y0o, y4o); \
+         __m256i x5 = _mm256_add_epi32(y1o, y5o); \
+         __m256i x6 = _mm256_add_epi32(y2o, y5o); \
+         __m256i x7 = _mm256_add_epi32(y3o, y4o); \
          dct_bfly32o(row0,row7, x0,x7,bias,shift); \
          dct_bfly32o(row1,row6, x1,x6,bias,shift); \
          dct_bfly32o(row2,row5, x2,x5,bias,shift); \
          dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
 
-   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
-   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
-   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
-   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
-   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
 
    // rounding biases in column/row passes, see stbi__idct_block for explanation.
-   __m128i bias_0 = _mm_set1_epi32(512);
-   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
 
    // load
    row0 = _mm_load_si128((const __m128i *) (data + 0*8));
@@ -2694,15 +4686,13 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_const
 #undef dct_rot
 #undef dct_widen
-#undef dct_wadd
-#undef dct_wsub
 #undef dct_bfly32o
 #undef dct_interleave8
 #undef dct_interleave16
 #undef dct_pass
 }
 
-#endif // STBI_SSE2
+#endif // STBI_AVX2
 
 #ifdef STBI_NEON
 
@@ -2946,12 +4936,299 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// whether block bx,by of component n has to be transformed
+stbi_inline static int stbi__jpeg_want_block(stbi__jpeg *z, int n, int bx, int by)
+{
+   if (n && z->luma_only) return 0;
+   return !z->roi || (bx >= z->img_comp[n].roi_bx0 && bx < z->img_comp[n].roi_bx1 &&
+                      by >= z->img_comp[n].roi_by0 && by < z->img_comp[n].roi_by1);
+}
+
+// decode one interleaved baseline MCU at MCU coordinates i,j
+stbi_inline static int stbi__jpeg_decode_baseline_mcu(stbi__jpeg *z, short data[64], int i, int j)
+{
+   int k,x,y;
+   // when streaming, the planes are a ring of 2 iMCU rows
+   int jr = z->stream ? j & 1 : j;
+   // scan an interleaved mcu... process scan_n components in order
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      // scan out an mcu's worth of this component; that's just determined
+      // by the basic H and V specified for the component
+      for (y=0; y < z->img_comp[n].v; ++y) {
+         for (x=0; x < z->img_comp[n].h; ++x) {
+            int bx = i*z->img_comp[n].h + x;
+            int by = j*z->img_comp[n].v + y;
+            int x2 = bx*z->idct_size;
+            int y2 = (jr*z->img_comp[n].v + y)*z->idct_size;
+            int ha = z->img_comp[n].ha;
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (stbi__jpeg_want_block(z, n, bx, by)) {
+               STBI__PROFILE_START(idct);
+               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               STBI__PROFILE_END(idct);
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+// multithreaded baseline decoding: the entropy decoder state (bit buffer and
+// dc predictions) is reset at every restart marker, so if the whole scan is
+// in memory we can find the RSTn markers up front and decode each restart
+// interval independently, writing into disjoint blocks of the component planes.
+// anything unusual makes us fall back to the serial path, which then also
+// produces the exact same result (and errors) for corrupt streams.
+
+#define STBI__JPEG_MAX_TASKS  64   // bounds the number of decoder copies we make
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__jpeg *worker;           // one decoder copy per task
+   stbi_uc **start, **end;       // bytes of each interval, including the marker that ends it
+   int *ok;                      // per-task result
+   int num_intervals, intervals_per_task, num_mcus;
+} stbi__jpeg_parallel;
+
+static void stbi__jpeg_decode_intervals(void *task_data, int t)
+{
+   stbi__jpeg_parallel *p = (stbi__jpeg_parallel *) task_data;
+   stbi__jpeg *j = &p->worker[t];
+   STBI_SIMD_ALIGN(short, data[64]);
+   stbi__context s;
+   int k = t * p->intervals_per_task;
+   int k_end = k + p->intervals_per_task;
+   int ok = 1;
+
+   if (k_end > p->num_intervals) k_end = p->num_intervals;
+   memcpy(j, p->z, sizeof(*j));
+   j->s = &s;
+   for (; ok && k < k_end; ++k) {
+      int m   = k * p->z->restart_interval;
+      int end = m + p->z->restart_interval;
+      if (end > p->num_mcus) end = p->num_mcus;
+      // the decoder sees exactly the bytes the serial path would, up to and
+      // including the marker, so it behaves identically even on corrupt data
+      stbi__start_mem(&s, p->start[k], (int) (p->end[k] - p->start[k]));
+      stbi__jpeg_reset(j);
+      if (j->scan_n == 1) {
+         int n = j->order[0];
+         int w = (j->img_comp[n].x+7) >> 3;
+         int ha = j->img_comp[n].ha;
+         for (; ok && m < end; ++m) {
+            int bx = m % w, by = m / w;
+            ok = stbi__jpeg_decode_block(j, data, j->huff_dc+j->img_comp[n].hd, j->huff_ac+ha, j->fast_ac[ha], n, j->dequant[j->img_comp[n].tq]);
+            if (ok && stbi__jpeg_want_block(j, n, bx, by)) {
+               STBI__PROFILE_START(idct);
+               j->idct_block_kernel(j->img_comp[n].data+(j->img_comp[n].w2*by+bx)*j->idct_size, j->img_comp[n].w2, data);
+               STBI__PROFILE_END(idct);
+            }
+         }
+      } else {
+         for (; ok && m < end; ++m)
+            ok = stbi__jpeg_decode_baseline_mcu(j, data, m % j->img_mcu_x, m / j->img_mcu_x);
+      }
+      // the serial path stops decoding (successfully) if it doesn't find the
+      // restart marker where it expects one; leave that case to it
+      if (ok && k+1 < p->num_intervals) {
+         if (j->code_bits < 24) stbi__grow_buffer_unsafe(j);
+         if (!STBI__RESTART(j->marker)) ok = 0;
+      }
+   }
+   p->ok[t] = ok;
+}
+
+// returns 1 if the scan was fully decoded, 0 if the caller should decode it serially
+static int stbi__jpeg_parse_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_parallel p;
+   stbi_uc *q, *end = z->s->img_buffer_end;
+   int num_tasks, k, n, result = 1, marker = STBI__MARKER_none;
+   void *mem;
+
+   if (z->scan_n == 1) {
+      n = z->order[0];
+      p.num_mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      p.num_mcus = z->img_mcu_x * z->img_mcu_y;
+   p.num_intervals = (p.num_mcus + z->restart_interval-1) / z->restart_interval;
+   if (p.num_intervals < 2) return 0;
+
+   num_tasks = p.num_intervals < STBI__JPEG_MAX_TASKS ? p.num_intervals : STBI__JPEG_MAX_TASKS;
+   p.intervals_per_task = (p.num_intervals + num_tasks-1) / num_tasks;
+   num_tasks = (p.num_intervals + p.intervals_per_task-1) / p.intervals_per_task;
+
+   mem = stbi__malloc_mad2(p.num_intervals, 2*sizeof(stbi_uc *), 0);
+   if (!mem) return 0;
+   p.start = (stbi_uc **) mem;
+   p.end = p.start + p.num_intervals;
+
+   // find the restart markers; a stuffed 0xff00 is data, any other marker
+   // (or a restart marker after the last interval) ends the scan
+   p.start[0] = q = z->s->img_buffer;
+   k = 0;
+   for (;;) {
+      q = (stbi_uc *) memchr(q, 0xff, end - q);
+      if (q == NULL) { p.end[k] = end; break; }
+      while (q < end && *q == 0xff) ++q; // fill bytes
+      if (q == end) { p.end[k] = end; break; }
+      if (*q == 0x00) { ++q; continue; }
+      p.end[k] = ++q;
+      if (!STBI__RESTART(q[-1]) || k+1 == p.num_intervals) { marker = q[-1]; break; }
+      p.start[++k] = q;
+   }
+   if (k+1 != p.num_intervals) { stbi__free(mem); return 0; }
+
+   p.z = z;
+   p.worker = (stbi__jpeg *) stbi__malloc_mad2(num_tasks, sizeof(stbi__jpeg) + sizeof(int), 0);
+   if (!p.worker) { stbi__free(mem); return 0; }
+   p.ok = (int *) (p.worker + num_tasks);
+
+   stbi__parallel_for(stbi__parallel_for_user, stbi__jpeg_decode_intervals, &p, num_tasks);
+
+   for (k=0; k < num_tasks; ++k)
+      if (!p.ok[k]) result = 0;
+   if (result) {
+      // continue after the scan, with the marker that ended it pending
+      z->s->img_buffer = p.end[p.num_intervals-1];
+      z->marker = (unsigned char) marker;
+   }
+   stbi__free(p.worker);
+   stbi__free(mem);
+   return result;
+}
+
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int lines, stbi_uc *output);
+
+// progressive images keep their coefficients in bands of this many iMCU
+// rows, so the final pass can free each band as soon as it's converted
+#define STBI__JPEG_FINISH_BAND  4
+
+// coefficients of block i,j of component n
+stbi_inline static short *stbi__jpeg_coeff(stbi__jpeg *z, int n, int i, int j)
+{
+   int b = j / z->img_comp[n].coeff_band_h;
+   j -= b * z->img_comp[n].coeff_band_h;
+   return z->img_comp[n].coeff[b] + 64 * (i + j * z->img_comp[n].coeff_w);
+}
+
+// region loads: if none of the blocks in the restart interval starting at
+// MCU m (of per_row x rows MCUs in the scan) are needed, skip its bytes up to
+// the marker that ends it, just as the entropy decoder would have stopped
+// there, and return the number of MCUs skipped; otherwise return 0
+static int stbi__jpeg_skip_interval(stbi__jpeg *z, int m, int per_row, int rows)
+{
+   stbi__context *s = z->s;
+   int count = per_row * rows - m;
+   int i0, j0, i1, j1, k, c;
+   if (count > z->restart_interval) count = z->restart_interval;
+   i0 = m % per_row; j0 = m / per_row;
+   i1 = (m+count-1) % per_row; j1 = (m+count-1) / per_row;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      int h = z->scan_n == 1 ? 1 : z->img_comp[n].h;
+      int v = z->scan_n == 1 ? 1 : z->img_comp[n].v;
+      if ((j1+1)*v <= z->img_comp[n].roi_by0 || j0*v >= z->img_comp[n].roi_by1) continue;
+      if (j0 == j1 && ((i1+1)*h <= z->img_comp[n].roi_bx0 || i0*h >= z->img_comp[n].roi_bx1)) continue;
+      return 0;
+   }
+
+   while (!stbi__at_eof(s)) {
+      stbi_uc *p = (stbi_uc *) memchr(s->img_buffer, 0xff, s->img_buffer_end - s->img_buffer);
+      if (p) {
+         s->img_buffer = p+1;
+      } else {
+         s->img_buffer = s->img_buffer_end;
+         if (stbi__get8(s) != 0xff) continue; // refilled from the callbacks
+      }
+      do c = stbi__get8(s); while (c == 0xff);
+      if (c != 0) {
+         z->marker = (unsigned char) c;
+         break;
+      }
+   }
+   z->nomore = 1;
+   return count;
+}
+
+// resumable decoding: save the decoder state at the start of iMCU row 'row'
+static void stbi__jpeg_push_mark(stbi__jpeg *z, int row)
+{
+   stbi__jpeg_mark *m = &z->mark;
+   int k;
+   m->row = row;
+   m->pos = (int) (z->s->img_buffer - z->s->img_buffer_original);
+   m->code_buffer = z->code_buffer;
+   m->code_bits = z->code_bits;
+   m->marker = z->marker;
+   m->nomore = z->nomore;
+   m->todo = z->todo;
+   m->eob_run = z->eob_run;
+   for (k=0; k < 4; ++k)
+      m->dc_pred[k] = z->img_comp[k].dc_pred;
+}
+
+// ...and go back to it
+static void stbi__jpeg_push_restore(stbi__jpeg *z)
+{
+   stbi__jpeg_mark *m = &z->mark;
+   int k;
+   z->s->img_buffer = z->s->img_buffer_original + m->pos;
+   z->code_buffer = m->code_buffer;
+   z->code_bits = m->code_bits;
+   z->marker = m->marker;
+   z->nomore = m->nomore;
+   z->todo = m->todo;
+   z->eob_run = m->eob_run;
+   for (k=0; k < 4; ++k)
+      z->img_comp[k].dc_pred = m->dc_pred[k];
+}
+
+// resumable decoding: whether the decoder has got to the end of the input
+// so far, so that what it decoded may have been made up of padding
+static int stbi__jpeg_push_starved(stbi__jpeg *z)
+{
+   return z->push_more && z->s->img_buffer >= z->s->img_buffer_end;
+}
+
+// streaming, at the end of iMCU row j: pass on the output rows whose source
+// lines are within the first 'lines' rows; returns 0 on error, 1 to carry
+// on, and 2 if the step is out of budget (resumable decoding)
+static int stbi__jpeg_row_end(stbi__jpeg *z, int j, int lines)
+{
+   int row_pixels;
+   if (z->push && stbi__jpeg_push_starved(z)) return 0; // stbi__push_jpeg goes back to the mark
+   if (!stbi__jpeg_stream_rows(z, lines, NULL)) return 0;
+   if (!z->push) return 1;
+   stbi__jpeg_push_mark(z, j+1);
+   row_pixels = (int) z->s->img_x * (lines / (j+1));
+   z->push_budget -= row_pixels;
+   if (z->push_budget >= row_pixels) return 1;
+   z->push_paused = 1;
+   return 2;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
-   stbi__jpeg_reset(z);
+   int j0 = 0;
+   if (z->push && z->mark.row >= 0) {
+      j0 = z->mark.row; // carry on where the last step stopped
+   } else {
+      stbi__jpeg_reset(z);
+      if (z->push) {
+         // the scan header may have been made up of padding
+         if (stbi__jpeg_push_starved(z)) return 0;
+         stbi__jpeg_push_mark(z, 0);
+      }
+   }
+   if (!z->progressive && !z->stream && z->restart_interval && stbi__parallel_for && !stbi__io_callbacks(z->s))
+      if (stbi__jpeg_parse_parallel(z))
+         return 1;
    if (!z->progressive) {
       if (z->scan_n == 1) {
-         int i,j;
+         int i,j,skip=0;
          STBI_SIMD_ALIGN(short, data[64]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
@@ -2960,11 +5237,20 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
+         for (j=j0; j < h; ++j) {
+            // when streaming, the plane is a ring of 2 iMCU rows
+            int jr = z->stream ? j % (2*z->img_comp[n].v) : j;
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->roi && !skip && z->todo == z->restart_interval)
+                  skip = stbi__jpeg_skip_interval(z, j*w + i, w, h);
+               if (skip) --skip;
+               else if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               if (stbi__jpeg_want_block(z, n, i, j)) {
+                  STBI__PROFILE_START(idct);
+                  z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*jr+i)*z->idct_size, z->img_comp[n].w2, data);
+                  STBI__PROFILE_END(idct);
+               }
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2974,28 +5260,21 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->stream) {
+               int r = stbi__jpeg_row_end(z, j, (j+1) * z->idct_size);
+               if (r != 1) return r;
+            }
          }
          return 1;
       } else { // interleaved
-         int i,j,k,x,y;
+         int i,j,skip=0;
          STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
+         for (j=j0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
+               if (z->roi && !skip && z->todo == z->restart_interval)
+                  skip = stbi__jpeg_skip_interval(z, j*z->img_mcu_x + i, z->img_mcu_x, z->img_mcu_y);
+               if (skip) --skip;
+               else if (!stbi__jpeg_decode_baseline_mcu(z, data, i, j)) return 0;
                // after all interleaved components, that's an interleaved MCU,
                // so now count down the restart interval
                if (--z->todo <= 0) {
@@ -3004,6 +5283,10 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->stream) {
+               int r = stbi__jpeg_row_end(z, j, (j+1) * z->img_v_max * z->idct_size);
+               if (r != 1) return r;
+            }
          }
          return 1;
       }
@@ -3019,7 +5302,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               short *data = stbi__jpeg_coeff(z, n, i, j);
                if (z->spec_start == 0) {
                   if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                      return 0;
@@ -3050,7 +5333,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                      for (x=0; x < z->img_comp[n].h; ++x) {
                         int x2 = (i*z->img_comp[n].h + x);
                         int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                        short *data = stbi__jpeg_coeff(z, n, x2, y2);
                         if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                            return 0;
                      }
@@ -3077,23 +5360,74 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+// final pass for progressive images: dequantize and idct the stored
+// coefficients. this goes a band at a time, converting the rows of each
+// band to the output (or passing them on, if 'output' is NULL) before
+// freeing its coefficients and reusing its part of the component planes.
+// within a band, every block row of every component is independent, so
+// they can go to the parallel-for hook
+
+typedef struct
+{
+   stbi__jpeg *z;
+   int band;
+   int rows[4];  // block rows of each component in this band
+} stbi__jpeg_finish_band;
+
+static void stbi__jpeg_finish_row(void *task_data, int t)
 {
-   if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
+   stbi__jpeg_finish_band *f = (stbi__jpeg_finish_band *) task_data;
+   stbi__jpeg *z = f->z;
+   int i, j, n = 0, w;
+   stbi_uc *out;
+   while (t >= f->rows[n])
+      t -= f->rows[n++];
+   j = f->band * z->img_comp[n].coeff_band_h + t;
+   w = (z->img_comp[n].x+7) >> 3;
+   // the planes hold two bands, or the whole image if that's smaller
+   out = z->img_comp[n].data + z->img_comp[n].w2 * ((j * z->idct_size) % z->img_comp[n].h2);
+   STBI__PROFILE_START(idct);
+   for (i=0; i < w; ++i) {
+      short *data = stbi__jpeg_coeff(z, n, i, j);
+      if (!stbi__jpeg_want_block(z, n, i, j)) continue;
+      stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+      z->idct_block_kernel(out + i*z->idct_size, z->img_comp[n].w2, data);
+   }
+   STBI__PROFILE_END(idct);
+}
+
+static int stbi__jpeg_finish(stbi__jpeg *z, stbi_uc *output)
+{
+   stbi__jpeg_finish_band f;
+   int b, n, t, num, lines;
+   f.z = z;
+   for (b=0; b < z->coeff_bands; ++b) {
+      f.band = b;
+      num = 0;
       for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
+         int j = b * z->img_comp[n].coeff_band_h;
+         f.rows[n] = h - j < z->img_comp[n].coeff_band_h ? h - j : z->img_comp[n].coeff_band_h;
+         if (f.rows[n] < 0 || (n && z->luma_only)) f.rows[n] = 0;
+         num += f.rows[n];
+      }
+      if (stbi__parallel_for && num > 1)
+         stbi__parallel_for(stbi__parallel_for_user, stbi__jpeg_finish_row, &f, num);
+      else
+         for (t=0; t < num; ++t)
+            stbi__jpeg_finish_row(&f, t);
+
+      for (n=0; n < z->s->img_n; ++n) {
+         stbi__free(z->img_comp[n].raw_coeff[b]);
+         z->img_comp[n].raw_coeff[b] = NULL;
       }
+
+      if (z->planar) continue; // the planes are the output
+      lines = (b+1) * STBI__JPEG_FINISH_BAND;
+      if (lines > z->img_mcu_y) lines = z->img_mcu_y;
+      if (!stbi__jpeg_stream_rows(z, lines * z->img_v_max * z->idct_size, output)) return 0;
    }
+   return 1;
 }
 
 static int stbi__process_marker(stbi__jpeg *z, int m)
@@ -3126,8 +5460,9 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
       case 0xC4: // DHT - define huffman table
          L = stbi__get16be(z->s)-2;
          while (L > 0) {
-            stbi_uc *v;
-            int sizes[16],i,n=0;
+            stbi__huffman *h;
+            stbi_uc *key = NULL;
+            int sizes[16],i,n=0,same=0;
             int q = stbi__get8(z->s);
             int tc = q >> 4;
             int th = q & 15;
@@ -3138,17 +5473,26 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
             }
             if(n > 256) return stbi__err("bad DHT header","Corrupt JPEG"); // Loop over i < n would write past end of values!
             L -= 17;
-            if (tc == 0) {
-               if (!stbi__build_huffman(z->huff_dc+th, sizes)) return 0;
-               v = z->huff_dc[th].values;
-            } else {
-               if (!stbi__build_huffman(z->huff_ac+th, sizes)) return 0;
-               v = z->huff_ac[th].values;
+            h = tc == 0 ? z->huff_dc+th : z->huff_ac+th;
+            if (z->keep) {
+               // the code tables only depend on the counts, fast_ac on the values too
+               key = z->keep->dht[tc*4 + th];
+               same = z->keep->dht_n[tc*4 + th] == n;
+               for (i=0; i < 16; ++i)
+                  if (key[i] != sizes[i]) same = 0;
+               z->keep->dht_n[tc*4 + th] = -1;
             }
+            if (!same && !stbi__build_huffman(h, sizes)) return 0;
             for (i=0; i < n; ++i)
-               v[i] = stbi__get8(z->s);
-            if (tc != 0)
-               stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
+               h->values[i] = stbi__get8(z->s);
+            if (tc != 0 && !(same && memcmp(h->values, key+16, n) == 0))
+               stbi__build_fast_ac(z->fast_ac[th], h);
+            if (key) {
+               for (i=0; i < 16; ++i)
+                  key[i] = (stbi_uc) sizes[i];
+               memcpy(key+16, h->values, n);
+               z->keep->dht_n[tc*4 + th] = n;
+            }
             L -= n;
          }
          return L==0;
@@ -3243,24 +5587,85 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
 {
    int i;
    for (i=0; i < ncomp; ++i) {
-      if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+      if (z->img_comp[i].raw_data && !z->keep) {
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         int b;
+         for (b=0; b < z->coeff_bands; ++b)
+            stbi__free(z->img_comp[i].raw_coeff[b]);
+         stbi__free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
-      if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+      if (z->img_comp[i].linebuf && !z->keep) {
+         stbi__free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
    return why;
 }
 
+static int stbi__jpeg_alloc_plane(stbi__jpeg *z, int i)
+{
+   if (!stbi__mad2sizes_valid(z->img_comp[i].w2, z->img_comp[i].h2, 15)) return 0;
+   z->img_comp[i].raw_data = stbi__jpeg_buffer(z, z->img_comp[i].raw_data, &z->img_comp[i].raw_size, (size_t) z->img_comp[i].w2 * z->img_comp[i].h2 + 15);
+   if (z->img_comp[i].raw_data == NULL)
+      return 0;
+   // align blocks for idct using mmx/sse
+   z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   return 1;
+}
+
+static int stbi__jpeg_alloc_planes(stbi__jpeg *z)
+{
+   int i, size = 0;
+   stbi_uc *p;
+   for (i=0; i < z->s->img_n; ++i) {
+      if (!stbi__mad2sizes_valid(z->img_comp[i].w2, z->img_comp[i].h2, 15)) return 0;
+      if (!stbi__addints_valid(size, z->img_comp[i].w2 * z->img_comp[i].h2 + 15)) return 0;
+      size += z->img_comp[i].w2 * z->img_comp[i].h2 + 15;
+   }
+   z->img_comp[0].raw_data = stbi__malloc(size);
+   if (z->img_comp[0].raw_data == NULL)
+      return 0;
+   p = (stbi_uc *) z->img_comp[0].raw_data;
+   for (i=0; i < z->s->img_n; ++i) {
+      z->img_comp[i].data = (stbi_uc*) (((size_t) p + 15) & ~15);
+      p = z->img_comp[i].data + z->img_comp[i].w2 * z->img_comp[i].h2;
+   }
+   return 1;
+}
+
+static int stbi__jpeg_alloc_coeff(stbi__jpeg *z, int i)
+{
+   int b, h = z->img_comp[i].coeff_band_h;
+   void **mem = (void **) stbi__malloc_mad2(z->coeff_bands, sizeof(void *) + sizeof(short *), 0);
+   if (mem == NULL)
+      return 0;
+   z->img_comp[i].raw_coeff = mem;
+   z->img_comp[i].coeff = (short **) (mem + z->coeff_bands);
+   for (b=0; b < z->coeff_bands; ++b)
+      mem[b] = NULL;
+   for (b=0; b < z->coeff_bands; ++b) {
+      int rows = z->img_comp[i].coeff_h - b*h;
+      if (rows > h) rows = h;
+      mem[b] = stbi__malloc_mad3(z->img_comp[i].coeff_w * rows, 64, sizeof(short), 15);
+      if (mem[b] == NULL)
+         return 0;
+      z->img_comp[i].coeff[b] = (short*) (((size_t) mem[b] + 15) & ~15);
+   }
+   return 1;
+}
+
+// three components that are RGB rather than YCbCr
+static int stbi__jpeg_is_rgb(stbi__jpeg *z)
+{
+   return z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3276,7 +5681,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    s->img_n = c;
    for (i=0; i < c; ++i) {
       z->img_comp[i].data = NULL;
-      z->img_comp[i].linebuf = NULL;
+      if (!z->keep) z->img_comp[i].linebuf = NULL;
    }
 
    if (Lf != 8+3*s->img_n) return stbi__err("bad SOF len","Corrupt JPEG");
@@ -3317,6 +5722,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    // these sizes can't be more than 17 bits
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->coeff_bands = (z->img_mcu_y + STBI__JPEG_FINISH_BAND-1) / STBI__JPEG_FINISH_BAND;
+
+   // APP0/APP14 come before the frame header in practice, so whether the
+   // components are RGB is known by now (see also stbi__jpeg_recheck_luma_only)
+   z->luma_only = (z->req_comp == 1 || z->req_comp == 2) && s->img_n == 3 && !stbi__jpeg_is_rgb(z);
 
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
@@ -3329,26 +5739,34 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->idct_size;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->idct_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
-      z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
+      if (!z->keep) z->img_comp[i].linebuf = NULL;
+      // progressive images are converted a band at a time at the end
+      // (see stbi__jpeg_finish), so the planes only need two bands, unless
+      // they are the output
+      if (z->progressive) {
+         if (z->img_mcu_y > 2 * STBI__JPEG_FINISH_BAND && !z->planar)
+            z->img_comp[i].h2 = 2 * STBI__JPEG_FINISH_BAND * z->img_comp[i].v * z->idct_size;
+      } else if (z->stream && z->img_mcu_y > 2)
+         z->img_comp[i].h2 = 2 * z->img_comp[i].v * z->idct_size;
+      // planar planes are allocated together after the loop, and luma-only
+      // decoding has no chroma planes
+      if (!z->planar && !(i && z->luma_only) && !stbi__jpeg_alloc_plane(z, i))
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-         if (z->img_comp[i].raw_coeff == NULL)
+         // w2 is a multiple of idct_size (see above)
+         z->img_comp[i].coeff_w = z->img_comp[i].w2 / z->idct_size;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].coeff_band_h = STBI__JPEG_FINISH_BAND * z->img_comp[i].v;
+         if (!stbi__jpeg_alloc_coeff(z, i))
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
       }
    }
+   if (z->planar && !stbi__jpeg_alloc_planes(z))
+      return stbi__free_jpeg_components(z, s->img_n, stbi__err("outofmem", "Out of memory"));
 
    return 1;
 }
@@ -3408,12 +5826,56 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
    return STBI__MARKER_none;
 }
 
-// decode image to YCbCr format
+static int stbi__jpeg_begin_output(stbi__jpeg *z, int req_comp);
+
+// output rows waiting to be passed on when streaming, see stbi__jpeg_stream_rows
+static int stbi__jpeg_alloc_band(stbi__jpeg *z)
+{
+   int w = z->out_x1 - z->out_x0, rows = z->img_v_max * z->idct_size;
+   if (!stbi__mad3sizes_valid(z->out_n, w, rows, 1)) return 0;
+   z->band = (stbi_uc *) stbi__jpeg_buffer(z, z->band, &z->band_size, (size_t) z->out_n * w * rows + 1);
+   return z->band != NULL;
+}
+
+// called at the first scan when streaming: if it holds all components of a
+// baseline image, rows can be converted while decoding; otherwise switch
+// back to full-size planes
+static int stbi__jpeg_stream_begin(stbi__jpeg *z)
+{
+   int i;
+   if (z->scan_n != z->s->img_n) {
+      z->stream = 0;
+      for (i=0; i < z->s->img_n; ++i) {
+         z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->idct_size;
+         if (i && z->luma_only) continue;
+         if (!stbi__jpeg_alloc_plane(z, i)) return stbi__err("outofmem", "Out of memory");
+      }
+      return 1;
+   }
+   if (!stbi__jpeg_begin_output(z, z->req_comp)) return 0;
+   if (!stbi__jpeg_alloc_band(z)) return stbi__err("outofmem", "Out of memory");
+   stbi__rows_begin(z->s, z->s->img_n >= 3 ? 3 : 1);
+   return 1;
+}
+
+// at the first scan: markers between the frame header and the scan can
+// still make the components RGB, and then the chroma planes are needed
+static int stbi__jpeg_recheck_luma_only(stbi__jpeg *z)
+{
+   int i;
+   if (!z->luma_only || !stbi__jpeg_is_rgb(z)) return 1;
+   z->luma_only = 0;
+   for (i=1; i < z->s->img_n; ++i)
+      if (!stbi__jpeg_alloc_plane(z, i)) return stbi__err("outofmem", "Out of memory");
+   return 1;
+}
+
+// decode image to YCbCr format (progressive: to coefficients, see stbi__jpeg_finish)
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, ok, scans = 0;
    for (m = 0; m < 4; m++) {
-      j->img_comp[m].raw_data = NULL;
+      if (!j->keep) j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
    }
    j->restart_interval = 0;
@@ -3422,7 +5884,22 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (scans++ == 0 && !stbi__jpeg_recheck_luma_only(j)) return 0;
+         // progressive images are only streamed in the final pass
+         if (j->stream && !j->progressive && !stbi__jpeg_stream_begin(j)) return 0;
+         // resumable decoding only goes on with a scan it can stop in
+         if (j->push && (!j->stream || j->progressive)) return 1;
+         STBI__PROFILE_START(entropy);
+         ok = stbi__parse_entropy_coded_data(j);
+         STBI__PROFILE_END(entropy);
+         if (!ok) return 0;
+         if (j->stream && !j->progressive) {
+            // the whole image was in this scan, so pass on the remaining
+            // rows and ignore the rest of the file (stbi__push_jpeg does
+            // that itself, once it gets to the end of the scan)
+            if (j->push) return 1;
+            return stbi__jpeg_stream_rows(j, j->img_mcu_y * j->img_v_max * j->idct_size, NULL);
+         }
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3441,16 +5918,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          m = stbi__get_marker(j);
       }
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
    return 1;
 }
 
 // static jfif-centered resampling (across block boundaries)
 
-typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
-                                    int w, int hs);
-
 #define stbi__div4(x) ((stbi_uc) ((x) >> 2))
 
 static stbi_uc *resample_row_1(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
@@ -3538,6 +6010,42 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
    }
 
    t1 = 3*in_near[0] + in_far[0];
+#ifdef STBI_AVX2
+   // same as the 8-pixel loop below, 16 pixels at a time
+   for (; i < ((w-1) & ~15); i += 16) {
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // shifting by one pixel has to cross the 128-bit lanes, so
+      // alignr against a lane-swapped copy of curr.
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave and pack both work within lanes, which happens to put
+      // the 32 output pixels back in order.
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+#endif
    // process groups of 8 pixels for as long as we can.
    // note we can't handle the last pixel in a row in this loop
    // because we need to handle the filter boundary conditions.
@@ -3701,6 +6209,62 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
       __m128i xw = _mm_set1_epi16(255); // alpha channel
 
+#ifdef STBI_AVX2
+      {
+         // 16 pixels at a time; same math as the 8-pixel loop below
+         __m256i cr_const0w = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+         __m256i cr_const1w = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+         __m256i cb_const0w = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+         __m256i cb_const1w = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+         __m256i xww = _mm256_set1_epi16(255);
+
+         for (; i+15 < count; i += 16) {
+            // load
+            __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+            __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+            __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+            __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+            __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+            // widen to short with the byte in the high half, matching the
+            // unpacks in the sse2 loop
+            __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), _mm256_set1_epi16(128));
+            __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+            __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+
+            // color transform
+            __m256i yws = _mm256_srli_epi16(yw, 4);
+            __m256i cr0 = _mm256_mulhi_epi16(cr_const0w, crw);
+            __m256i cb0 = _mm256_mulhi_epi16(cb_const0w, cbw);
+            __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1w);
+            __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1w);
+            __m256i rws = _mm256_add_epi16(cr0, yws);
+            __m256i gwt = _mm256_add_epi16(cb0, yws);
+            __m256i bws = _mm256_add_epi16(yws, cb1);
+            __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+            // descale
+            __m256i rw = _mm256_srai_epi16(rws, 4);
+            __m256i bw = _mm256_srai_epi16(bws, 4);
+            __m256i gw = _mm256_srai_epi16(gws, 4);
+
+            // back to byte and transpose, all within 128-bit lanes: the low
+            // lane ends up with pixels 0-3 and 4-7, the high lane 8-11 and 12-15
+            __m256i brb = _mm256_packus_epi16(rw, bw);
+            __m256i gxb = _mm256_packus_epi16(gw, xww);
+            __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+            __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+            __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+            __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+            // store
+            _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+            out += 64;
+         }
+      }
+#endif
+
       for (; i+7 < count; i += 8) {
          // load
          __m128i y_bytes = _mm_loadl_epi64((__m128i *) (y+i));
@@ -3820,6 +6384,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->idct_size = 8;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3829,6 +6394,9 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+#ifdef STBI_AVX2
+      j->idct_block_kernel = stbi__idct_avx2;
+#endif
    }
 #endif
 
@@ -3839,203 +6407,409 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
 #endif
 }
 
-// clean up the temporary component buffers
-static void stbi__cleanup_jpeg(stbi__jpeg *j)
+// clean up the temporary component buffers
+static void stbi__cleanup_jpeg(stbi__jpeg *j)
+{
+   stbi__free_jpeg_components(j, j->s->img_n, 0);
+   if (!j->keep) {
+      stbi__free(j->band);
+      j->band = NULL;
+   }
+}
+
+// fast 0..255 * 0..255 => 0..255 rounded multiplication
+static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+{
+   unsigned int t = x*y + 128;
+   return (stbi_uc) ((t + (t >>8)) >> 8);
+}
+
+// set up resampling and color conversion of the decoded planes into
+// req_comp-channel rows; with DCT-domain downscaling, img_x and img_y
+// become the dimensions of the reduced image from here on
+static int stbi__jpeg_begin_output(stbi__jpeg *z, int req_comp)
+{
+   int k;
+   int shift = z->idct_size == 8 ? 0 : z->idct_size == 4 ? 1 : z->idct_size == 2 ? 2 : 3;
+   int round = (1 << shift) - 1;
+   z->s->img_x = (z->s->img_x + round) >> shift;
+   z->s->img_y = (z->s->img_y + round) >> shift;
+
+   // determine actual number of components to generate
+   z->out_n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   // (luma-only decoding has already decided the components are not RGB)
+   z->is_rgb = stbi__jpeg_is_rgb(z) && !z->luma_only;
+
+   if (z->s->img_n == 3 && z->out_n < 3 && !z->is_rgb)
+      z->decode_n = 1;
+   else
+      z->decode_n = z->s->img_n;
+
+   // nothing to do if no components requested; check this now to avoid
+   // accessing uninitialized coutput[0] later
+   if (z->decode_n <= 0) return 0;
+
+   z->out_x0 = 0;
+   z->out_x1 = z->s->img_x;
+   z->roi_y0 = 0;
+   z->roi_y1 = z->s->img_y;
+   if (z->stream && z->s->rows->mode == STBI__ROWS_region) {
+      stbi__rows *rows = z->s->rows;
+      int hm = z->img_h_max;
+      if (!stbi__rows_region(z->s)) return 0;
+      // odd sampling factors resample unevenly; just convert everything then
+      z->roi = 1;
+      for (k=0; k < z->decode_n; ++k)
+         if (hm % z->img_comp[k].h || z->img_v_max % z->img_comp[k].v)
+            z->roi = 0;
+      if (z->roi) {
+         // the upsamplers treat the first and last sample they get as an
+         // edge, and an output pixel can use the samples either side of its
+         // own, so compute hm more pixels each side: at least one sample of
+         // every component
+         z->out_x0 = (rows->rx0 / hm - 1) * hm;
+         z->out_x1 = ((rows->rx0 + rows->rw + hm-1) / hm + 1) * hm;
+         if (z->out_x0 < 0) z->out_x0 = 0;
+         if (z->out_x1 > (int) z->s->img_x) z->out_x1 = z->s->img_x;
+         z->roi_y0 = rows->flip ? z->s->img_y - (rows->ry0 + rows->rh) : (stbi__uint32) rows->ry0;
+         z->roi_y1 = z->roi_y0 + rows->rh;
+         rows->cropped = 1;
+         for (k=z->decode_n; k < z->s->img_n; ++k)
+            z->img_comp[k].roi_bx1 = z->img_comp[k].roi_by1 = 0;
+      }
+   }
+
+   for (k=0; k < z->decode_n; ++k) {
+      stbi__resample *r = &z->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__jpeg_buffer(z, z->img_comp[k].linebuf, &z->img_comp[k].linebuf_size, z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->x_lores = z->out_x0 / r->hs;
+      r->w_lores = (z->out_x1 + r->hs-1) / r->hs - r->x_lores;
+      r->h_lores = (z->img_comp[k].y + round) >> shift;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if (z->roi) {
+         // lores rows around each output row are used, see stbi__resample_row_hv_2
+         int y0 = (int) z->roi_y0 / r->vs - 1, y1 = (int) (z->roi_y1-1) / r->vs + 2;
+         if (y0 < 0) y0 = 0;
+         z->img_comp[k].roi_bx0 = r->x_lores / z->idct_size;
+         z->img_comp[k].roi_bx1 = (r->x_lores + r->w_lores + z->idct_size-1) / z->idct_size;
+         z->img_comp[k].roi_by0 = y0 / z->idct_size;
+         z->img_comp[k].roi_by1 = (y1 + z->idct_size-1) / z->idct_size;
+      }
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+   z->out_y = 0;
+   return 1;
+}
+
+// move the resampling of component k on to the next output row
+static void stbi__jpeg_next_row(stbi__jpeg *z, int k)
 {
-   stbi__free_jpeg_components(j, j->s->img_n, 0);
+   stbi__resample *r = &z->res_comp[k];
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < r->h_lores) {
+         r->line1 += z->img_comp[k].w2;
+         // wrap around if the plane is a ring of rows (streaming)
+         if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+            r->line1 = z->img_comp[k].data;
+      }
+   }
 }
 
-typedef struct
+// resample and color-convert the next row of output (columns out_x0..out_x1)
+static void stbi__jpeg_output_row(stbi__jpeg *z, stbi_uc *out)
 {
-   resample_row_func resample;
-   stbi_uc *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi__resample;
+   int k, n = z->out_n, img_n = z->s->img_n;
+   unsigned int i, w = z->out_x1 - z->out_x0;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
-// fast 0..255 * 0..255 => 0..255 rounded multiplication
-static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+   STBI__PROFILE_START(upsample);
+   for (k=0; k < z->decode_n; ++k) {
+      stbi__resample *r = &z->res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      coutput[k] = r->resample(z->img_comp[k].linebuf,
+                               (y_bot ? r->line1 : r->line0) + r->x_lores,
+                               (y_bot ? r->line0 : r->line1) + r->x_lores,
+                               r->w_lores, r->hs);
+      stbi__jpeg_next_row(z, k);
+   }
+   STBI__PROFILE_END(upsample);
+   STBI__PROFILE_START(color);
+   if (n >= 3) {
+      stbi_uc *y = coutput[0];
+      if (img_n == 3) {
+         if (z->is_rgb) {
+            for (i=0; i < w; ++i) {
+               out[0] = y[i];
+               out[1] = coutput[1][i];
+               out[2] = coutput[2][i];
+               out[3] = 255;
+               out += n;
+            }
+         } else {
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+         }
+      } else if (img_n == 4) {
+         if (z->app14_color_transform == 0) { // CMYK
+            for (i=0; i < w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(coutput[0][i], m);
+               out[1] = stbi__blinn_8x8(coutput[1][i], m);
+               out[2] = stbi__blinn_8x8(coutput[2][i], m);
+               out[3] = 255;
+               out += n;
+            }
+         } else if (z->app14_color_transform == 2) { // YCCK
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+            for (i=0; i < w; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(255 - out[0], m);
+               out[1] = stbi__blinn_8x8(255 - out[1], m);
+               out[2] = stbi__blinn_8x8(255 - out[2], m);
+               out += n;
+            }
+         } else { // YCbCr + alpha?  Ignore the fourth channel for now
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+         }
+      } else
+         for (i=0; i < w; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      if (z->is_rgb) {
+         if (n == 1)
+            for (i=0; i < w; ++i)
+               *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+         else {
+            for (i=0; i < w; ++i, out += 2) {
+               out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+               out[1] = 255;
+            }
+         }
+      } else if (img_n == 4 && z->app14_color_transform == 0) {
+         for (i=0; i < w; ++i) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            out[1] = 255;
+            out += n;
+         }
+      } else if (img_n == 4 && z->app14_color_transform == 2) {
+         for (i=0; i < w; ++i) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            out[1] = 255;
+            out += n;
+         }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < w; ++i) out[i] = y[i];
+         else
+            for (i=0; i < w; ++i) { *out++ = y[i]; *out++ = 255; }
+      }
+   }
+   STBI__PROFILE_END(color);
+   ++z->out_y;
+}
+
+// output row y of the whole image, upside down if flipping on load. the
+// color conversion may write one byte past the end of the row; with the rows
+// going bottom-up that byte is in a row that's done already, so keep it
+static void stbi__jpeg_store_row(stbi__jpeg *z, stbi_uc *output, stbi__uint32 y)
 {
-   unsigned int t = x*y + 128;
-   return (stbi_uc) ((t + (t >>8)) >> 8);
+   size_t stride = (size_t) z->out_n * z->s->img_x;
+   if (z->s->flip) {
+      stbi_uc *row = output + stride * (z->s->img_y-1 - y);
+      stbi_uc keep = row[stride]; // the spare byte at the end of output, for y == 0
+      stbi__jpeg_output_row(z, row);
+      row[stride] = keep;
+   } else
+      stbi__jpeg_output_row(z, output + stride * y);
+}
+
+// pass on every output row whose source lines are within the first 'lines'
+// rows decoded (counting rows of a component with the maximum vertical
+// sampling factor); or, if 'output' is given, store them there
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int lines, stbi_uc *output)
+{
+   int band_rows = z->img_v_max * z->idct_size;
+   int stride = z->out_n * (z->out_x1 - z->out_x0);
+   // region loads pass on just the region columns
+   stbi_uc *band = z->band + (z->roi ? z->out_n * (z->s->rows->rx0 - z->out_x0) : 0);
+   int num = 0, k;
+   while (z->out_y < z->s->img_y) {
+      for (k=0; k < z->decode_n; ++k) {
+         stbi__resample *r = &z->res_comp[k];
+         int line1 = r->ypos < r->h_lores ? r->ypos : r->h_lores-1;
+         if (line1 >= lines / r->vs) break;
+      }
+      if (k < z->decode_n) break;
+      if (output) {
+         stbi__jpeg_store_row(z, output, z->out_y);
+         continue;
+      }
+      if (num == band_rows || (num && z->out_y >= z->roi_y1)) {
+         if (!stbi__rows_emit(z->s, band, z->out_n, z->out_y - num, num, stride)) return 0;
+         num = 0;
+      }
+      if (z->out_y < z->roi_y0 || z->out_y >= z->roi_y1) {
+         for (k=0; k < z->decode_n; ++k)
+            stbi__jpeg_next_row(z, k);
+         ++z->out_y;
+         continue;
+      }
+      stbi__jpeg_output_row(z, z->band + stride * num++);
+   }
+   if (num)
+      return stbi__rows_emit(z->s, band, z->out_n, z->out_y - num, num, stride);
+   return 1;
 }
 
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
-   int n, decode_n, is_rgb;
+   unsigned int j;
+   int ok;
+   stbi_uc *output;
    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
 
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   z->stream = z->s->rows != NULL;
+   z->req_comp = req_comp;
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   STBI__PROFILE_START(header);
+   ok = stbi__decode_jpeg_image(z);
+   STBI__PROFILE_END(header);
+   if (!ok) { stbi__cleanup_jpeg(z); return NULL; }
+
+   // when streaming a baseline image, every row has been passed on already
+   if ((z->stream && !z->progressive) || !stbi__jpeg_begin_output(z, req_comp)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   if (z->stream) {
+      // progressive: pass rows on from the final pass
+      if (stbi__jpeg_alloc_band(z)) {
+         stbi__rows_begin(z->s, z->s->img_n >= 3 ? 3 : 1);
+         stbi__jpeg_finish(z, NULL);
+      } else
+         stbi__err("outofmem", "Out of memory");
+      stbi__cleanup_jpeg(z);
+      return NULL;
+   }
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   // can't error after this so, this is safe
+   output = (stbi_uc *) stbi__malloc_mad3(z->out_n, z->s->img_x, z->s->img_y, 1);
+   if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
+   // now go ahead and resample
+   if (z->progressive)
+      stbi__jpeg_finish(z, output);
    else
-      decode_n = z->s->img_n;
+      for (j=0; j < z->s->img_y; ++j)
+         stbi__jpeg_store_row(z, output, j);
 
-   // nothing to do if no components requested; check this now to avoid
-   // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return output;
+}
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+static void stbi__jpeg_setup_downscale(stbi__jpeg *j)
+{
+   if (stbi__jpeg_downscale_on_load) {
+      static void (*const reduced_idct[3])(stbi_uc *out, int out_stride, short data[64]) =
+         { stbi__idct_block_4x4, stbi__idct_block_2x2, stbi__idct_block_1x1 };
+      j->idct_size = 8 >> stbi__jpeg_downscale_on_load;
+      j->idct_block_kernel = reduced_idct[stbi__jpeg_downscale_on_load-1];
    }
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
+   stbi__jpeg* j;
+   if (s->jpeg) {
+      // everything else is either set up by the decoder or meant to carry over
+      j = &s->jpeg->j;
+      j->roi = 0;
+   } else {
+      j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+      if (!j) return stbi__errpuc("outofmem", "Out of memory");
+      memset(j, 0, sizeof(stbi__jpeg));
+   }
+   ri->flipped = s->flip; // rows are written straight to their flipped places
+   j->s = s;
+   stbi__setup_jpeg(j);
+   stbi__jpeg_setup_downscale(j);
+   result = load_jpeg_image(j, x,y,comp,req_comp);
+   if (!s->jpeg) stbi__free(j);
+   return result;
+}
+
+// decode to planes and hand them over as they are (see stbi__jpeg::planar)
+static stbi_uc *stbi__jpeg_load_planes(stbi__context *s, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4])
+{
+   stbi_uc *result = NULL;
+   int i, shift, round;
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
+   j->planar = 1;
    stbi__setup_jpeg(j);
-   result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   stbi__jpeg_setup_downscale(j);
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   if (stbi__decode_jpeg_image(j) && (!j->progressive || stbi__jpeg_finish(j, NULL))) {
+      shift = j->idct_size == 8 ? 0 : j->idct_size == 4 ? 1 : j->idct_size == 2 ? 2 : 3;
+      round = (1 << shift) - 1;
+      for (i=0; i < s->img_n; ++i) {
+         planes[i].data   = j->img_comp[i].data;
+         planes[i].w      = (j->img_comp[i].x + round) >> shift;
+         planes[i].h      = (j->img_comp[i].y + round) >> shift;
+         planes[i].stride = j->img_comp[i].w2;
+         planes[i].h_samp = j->img_comp[i].h;
+         planes[i].v_samp = j->img_comp[i].v;
+      }
+      *x = (s->img_x + round) >> shift;
+      *y = (s->img_y + round) >> shift;
+      if (num_planes) *num_planes = s->img_n;
+      if (colorspace) {
+         if (s->img_n == 1)
+            *colorspace = STBI_JPEG_GREY;
+         else if (s->img_n == 3)
+            *colorspace = stbi__jpeg_is_rgb(j) ? STBI_JPEG_RGB : STBI_JPEG_YCBCR;
+         else
+            *colorspace = j->app14_color_transform == 0 ? STBI_JPEG_CMYK : j->app14_color_transform == 2 ? STBI_JPEG_YCCK : STBI_JPEG_YCBCR;
+      }
+      result = (stbi_uc *) j->img_comp[0].raw_data;
+      j->img_comp[0].raw_data = NULL;
+   }
+   stbi__cleanup_jpeg(j);
+   stbi__free(j);
    return result;
 }
 
@@ -4049,7 +6823,7 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
@@ -4073,17 +6847,99 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    memset(j, 0, sizeof(stbi__jpeg));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4])
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_planes(&s,x,y,num_planes,colorspace,planes);
+}
+
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4])
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__jpeg_load_planes(&s,x,y,num_planes,colorspace,planes);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_jpeg_load_planes(char const *filename, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4])
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_jpeg_load_planes_from_file(f,x,y,num_planes,colorspace,planes);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_jpeg_load_planes_from_file(FILE *f, int *x, int *y, int *num_planes, int *colorspace, stbi_jpeg_plane planes[4])
+{
+   stbi_uc *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_planes(&s,x,y,num_planes,colorspace,planes);
+   if (result)
+      stbi__unget_file(&s);
+   stbi__stop_file(&s);
    return result;
 }
 #endif
 
+STBIDEF stbi_jpeg_decoder *stbi_jpeg_decoder_create(void)
+{
+   int i;
+   stbi_jpeg_decoder *d = (stbi_jpeg_decoder *) stbi__malloc(sizeof(*d));
+   if (!d) return (stbi_jpeg_decoder *) stbi__errpuc("outofmem", "Out of memory");
+   memset(d, 0, sizeof(*d));
+   d->j.keep = d;
+   for (i=0; i < 8; ++i)
+      d->dht_n[i] = -1;
+   return d;
+}
+
+STBIDEF void stbi_jpeg_decoder_free(stbi_jpeg_decoder *d)
+{
+   int i;
+   if (!d) return;
+   for (i=0; i < 4; ++i) {
+      stbi__free(d->j.img_comp[i].raw_data);
+      stbi__free(d->j.img_comp[i].linebuf);
+   }
+   stbi__free(d->j.band);
+   stbi__free(d);
+}
+
+STBIDEF stbi_uc *stbi_jpeg_decoder_load_from_memory(stbi_jpeg_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg = d;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_jpeg_decoder_load_into(stbi_jpeg_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_stride_in_bytes, int out_height)
+{
+   stbi__context s;
+   stbi__rows r;
+   if (!stbi__load_into_check(req_comp,out,out_stride_in_bytes,out_height)) return 0;
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg = d;
+   return stbi__load_rows_main(&s,x,y,comp,req_comp,stbi__rows_dest(&r,out,out_stride_in_bytes,out_height));
+}
+#endif
+
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
 //      - fast huffman
+//      - bulk of each block decoded with a word-sized bit buffer and a wide
+//        table that handles literal pairs and lengths in one lookup
 
 #ifndef STBI_NO_ZLIB
 
@@ -4092,6 +6948,45 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// the bulk of each huffman block is decoded by stbi__parse_huffman_fast,
+// using a word-sized bit buffer and a wider literal/length table whose
+// entries can also hold two literals, or a length with its extra bits
+#define STBI__ZWIDE_BITS  11
+#define STBI__ZWIDE_MASK  ((1 << STBI__ZWIDE_BITS) - 1)
+
+// wide table entries: bits 0-7 are the number of bits to consume, bits 8-11
+// the kind of entry (0 = not in the table), bits 12-15 the number of extra
+// bits still to read (LENX only), and bits 16-31 the value
+#define STBI__ZWIDE_LIT   1 // one literal
+#define STBI__ZWIDE_LIT2  2 // two literals, in bits 16-23 and 24-31
+#define STBI__ZWIDE_LEN   3 // match length, extra bits included
+#define STBI__ZWIDE_LENX  4 // match length base
+
+typedef size_t stbi__zbits; // 64 bits on 64-bit targets
+#define STBI__ZBITS  ((int) sizeof(stbi__zbits) * 8)
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+  #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #define STBI__ZLITTLE_ENDIAN
+  #endif
+#elif defined(_MSC_VER) || defined(__i386__) || defined(__x86_64__)
+  #define STBI__ZLITTLE_ENDIAN
+#endif
+
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -4121,7 +7016,9 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
+// build the decoding tables for a code; if 'wide' is given (literal/length
+// codes only), also fill in the wide table for stbi__parse_huffman_fast
+static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num, stbi__uint32 *wide)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
@@ -4129,6 +7026,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
    memset(z->fast, 0, sizeof(z->fast));
+   if (wide) memset(wide, 0, sizeof(*wide) << STBI__ZWIDE_BITS);
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -4162,19 +7060,70 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
                j += (1 << s);
             }
          }
+         if (wide && s <= STBI__ZWIDE_BITS && i != 256 && i < 286) {
+            int j = stbi__bit_reverse(next_code[s],s);
+            for (; j < (1 << STBI__ZWIDE_BITS); j += (1 << s)) {
+               if (i < 256) {
+                  wide[j] = s | (STBI__ZWIDE_LIT << 8) | (i << 16);
+               } else {
+                  int e = stbi__zlength_extra[i-257];
+                  int len = stbi__zlength_base[i-257];
+                  if (s + e <= STBI__ZWIDE_BITS)
+                     wide[j] = (s+e) | (STBI__ZWIDE_LEN << 8) | ((len + ((j >> s) & ((1 << e) - 1))) << 16);
+                  else
+                     wide[j] = s | (STBI__ZWIDE_LENX << 8) | (e << 12) | (len << 16);
+               }
+            }
+         }
          ++next_code[s];
       }
    }
+   if (wide) {
+      // pair up literals whose codes fit together; going downwards, the
+      // entry for the bits after the first code hasn't been paired yet
+      for (i = (1 << STBI__ZWIDE_BITS) - 1; i >= 0; --i) {
+         stbi__uint32 e1 = wide[i], e2;
+         if (((e1 >> 8) & 15) != STBI__ZWIDE_LIT) continue;
+         e2 = wide[i >> (e1 & 255)];
+         if (((e2 >> 8) & 15) == STBI__ZWIDE_LIT && (e1 & 255) + (e2 & 255) <= STBI__ZWIDE_BITS)
+            wide[i] = ((e1 & 255) + (e2 & 255)) | (STBI__ZWIDE_LIT2 << 8) | (e1 & 0xff0000) | ((e2 & 0xff0000) << 8);
+      }
+   }
    return 1;
 }
 
 // zlib-from-memory implementation for PNG reading
-//    because PNG allows splitting the zlib stream arbitrarily,
-//    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    normally the whole input is in memory and the whole output is
+//    buffered. PNG instead splits the zlib stream across IDAT chunks and
+//    only wants a few rows at a time, so it can install two hooks:
+//    'refill' is called when the input runs out, to point zbuffer at the
+//    next piece; and 'flush' is called when the output buffer is full,
+//    to take the output so far, after which everything but the last 32KB
+//    (the deflate window) and whatever flush didn't take is discarded
+//
+//    stbi__zinflate can also stop early and be called again to carry on,
+//    for decoding a step at a time (stbi_push): when 'zmore' says more
+//    input is still to come, it stops wherever the input it has might not
+//    be enough to get to the next symbol or block, and it stops once the
+//    output gets past 'zout_pause'
 
-typedef struct
+#define STBI__ZWINDOW   32768
+
+enum
+{
+   STBI__ZSTATE_header=0, // zlib header next
+   STBI__ZSTATE_block,    // block header next
+   STBI__ZSTATE_stored,   // in a stored block, with zstored bytes to go
+   STBI__ZSTATE_huffman,  // in a compressed block
+   STBI__ZSTATE_done
+};
+
+// the most input needed to get through a block header, or a symbol (a
+// length and distance, with their extra bits, and the bit buffer refills)
+#define STBI__ZMORE_BLOCK   512
+#define STBI__ZMORE_SYMBOL  16
+
+typedef struct stbi__zbuf
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
@@ -4186,12 +7135,25 @@ typedef struct
    char *zout_end;
    int   z_expandable;
 
+   // optional incremental input/output, see above
+   int (*refill)(struct stbi__zbuf *z);              // returns 0 at the end of the input
+   int (*flush)(void *user, stbi_uc *data, int len); // returns number of bytes used, or -1 on error
+   void *user;
+   char *zout_flushed;                               // output before this was taken by flush
+
+   // where stbi__zinflate is, and when to stop early (if zsuspend is set)
+   int zstate, zfinal, zstored;
+   int zsuspend;
+   int zmore;
+   char *zout_pause;
+
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_length_wide[1 << STBI__ZWIDE_BITS];
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   return (z->zbuffer >= z->zbuffer_end) && !(z->refill && z->refill(z));
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4221,12 +7183,14 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// decode a code that's not in the fast table from the next 16 bits of
+// input; returns the symbol and sets *size, or returns -1
+static int stbi__zhuffman_decode_bits(stbi__zhuffman *z, int bits, int *size)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse(bits, 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4235,9 +7199,17 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
+   *size = s;
+   return z->value[b];
+}
+
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   int s, v = stbi__zhuffman_decode_bits(z, a->code_buffer & 0xffff, &s);
+   if (v < 0) return -1;
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return v;
 }
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
@@ -4270,47 +7242,207 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// pass the output so far to z->flush, then slide down what we still need
+static int stbi__zflush(stbi__zbuf *z)
+{
+   char *keep;
+   int used = z->flush(z->user, (stbi_uc *) z->zout_flushed, (int) (z->zout - z->zout_flushed));
+   if (used < 0) return 0;
+   z->zout_flushed += used;
+   keep = z->zout - z->zout_start > STBI__ZWINDOW ? z->zout - STBI__ZWINDOW : z->zout_start;
+   if (keep > z->zout_flushed) keep = z->zout_flushed;
+   if (keep > z->zout_start) {
+      memmove(z->zout_start, keep, z->zout - keep);
+      z->zout_flushed -= keep - z->zout_start;
+      z->zout         -= keep - z->zout_start;
+      if (z->zout_pause)
+         z->zout_pause = z->zout_pause > keep ? z->zout_pause - (keep - z->zout_start) : z->zout_start;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
-   unsigned int cur, limit, old_limit;
+   unsigned int cur, limit, old_limit, flushed;
    z->zout = zout;
+   if (z->flush) {
+      if (!stbi__zflush(z)) return 0;
+      if (z->zout_end - z->zout >= n) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
+   flushed = (unsigned int) (z->zout_flushed - z->zout_start);
    if (UINT_MAX - cur < (unsigned) n) return stbi__err("outofmem", "Out of memory");
    while (cur + n > limit) {
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
+   z->zout_flushed = q + flushed;
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
+// decode as much of a huffman block as we can without having to check for
+// the end of the input or output buffers, i.e. while there are at least a
+// word of input and a maximum-length match of output space left. anything
+// unusual (end of block, invalid codes) is left to stbi__parse_huffman_block,
+// and whole bytes still in the bit buffer are given back to the input when
+// we stop, so it takes over exactly where we left off
+static int stbi__parse_huffman_fast(stbi__zbuf *a, char **pzout)
+{
+   stbi__zbits cb = a->code_buffer;
+   int nb = a->num_bits;
+   stbi_uc *in = a->zbuffer;
+   char *zout = *pzout;
+   char *zout_end = a->zout_end;
+   int give;
+
+   // and stop soon after zout_pause
+   if (a->zout_pause && a->zout_end - a->zout_pause > 258)
+      zout_end = a->zout_pause + 258;
+
+   while (a->zbuffer_end - in >= (int) sizeof(stbi__zbits) && zout_end - zout >= 258) {
+      stbi__uint32 e;
+      stbi_uc *p;
+      int z,s,len,dist;
+
+      // refill to at least STBI__ZBITS-8 bits, which is enough for a
+      // length and a distance code with their extra bits
+#ifdef STBI__ZLITTLE_ENDIAN
+      {
+         // load a whole word; the partial byte at the top is loaded again
+         // (to the same position) next time, so it doesn't matter that it's
+         // already there
+         stbi__zbits w;
+         memcpy(&w, in, sizeof(w));
+         cb |= w << nb;
+         in += (STBI__ZBITS-1 - nb) >> 3;
+         nb |= STBI__ZBITS-8;
+      }
+#else
+      while (nb <= STBI__ZBITS-8) {
+         cb |= (stbi__zbits) *in++ << nb;
+         nb += 8;
+      }
+#endif
 
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+      e = a->z_length_wide[cb & STBI__ZWIDE_MASK];
+      switch ((e >> 8) & 15) {
+         case STBI__ZWIDE_LIT:
+            *zout++ = (char) (e >> 16);
+            cb >>= e & 255;
+            nb -= e & 255;
+            continue;
+         case STBI__ZWIDE_LIT2:
+            zout[0] = (char) (e >> 16);
+            zout[1] = (char) (e >> 24);
+            zout += 2;
+            cb >>= e & 255;
+            nb -= e & 255;
+            continue;
+         case STBI__ZWIDE_LEN:
+            len = e >> 16;
+            cb >>= e & 255;
+            nb -= e & 255;
+            break;
+         case STBI__ZWIDE_LENX:
+            len = e >> 16;
+            cb >>= e & 255;
+            nb -= e & 255;
+            s = (e >> 12) & 15;
+            len += (int) (cb & ((1 << s) - 1));
+            cb >>= s;
+            nb -= s;
+            break;
+         default:
+            // codes of up to STBI__ZFAST_BITS are either in the wide table
+            // or something for the caller to deal with; longer ones are
+            // decoded here unless they're just as special
+            if (a->z_length.fast[cb & STBI__ZFAST_MASK]) goto done;
+            z = stbi__zhuffman_decode_bits(&a->z_length, (int) (cb & 0xffff), &s);
+            if (z < 0 || z == 256 || z >= 286) goto done;
+            cb >>= s;
+            nb -= s;
+            if (z < 256) {
+               *zout++ = (char) z;
+               continue;
+            }
+            z -= 257;
+            len = stbi__zlength_base[z];
+            s = stbi__zlength_extra[z];
+            len += (int) (cb & ((1 << s) - 1));
+            cb >>= s;
+            nb -= s;
+            break;
+      }
 
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+      z = a->z_distance.fast[cb & STBI__ZFAST_MASK];
+      if (z) {
+         s = z >> 9;
+         z &= 511;
+      } else {
+         z = stbi__zhuffman_decode_bits(&a->z_distance, (int) (cb & 0xffff), &s);
+      }
+      if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG"); // per DEFLATE, distance codes 30 and 31 must not appear in compressed data
+      cb >>= s;
+      nb -= s;
+      dist = stbi__zdist_base[z];
+      s = stbi__zdist_extra[z];
+      dist += (int) (cb & ((1 << s) - 1));
+      cb >>= s;
+      nb -= s;
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+
+      p = (stbi_uc *) (zout - dist);
+      if (dist >= 8) { // copy a word at a time; the source is at least a word behind
+         for (; len >= 8; len -= 8, zout += 8, p += 8)
+            memcpy(zout, p, 8);
+         while (len--) *zout++ = *p++;
+      } else if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+         zout += len;
+      } else {
+         do *zout++ = *p++; while (--len);
+      }
+   }
 
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+done:
+   // give back the whole bytes we read ahead, but only ones read here: with
+   // a refill hook, the input before a->zbuffer may be gone, so bits that
+   // were already in the code buffer stay there (at most 32 of them)
+   give = nb >> 3;
+   if (give > in - a->zbuffer) give = (int) (in - a->zbuffer);
+   in -= give;
+   nb -= give * 8;
+   a->code_buffer = (stbi__uint32) (cb & (((stbi__zbits) 1 << nb) - 1));
+   a->num_bits = nb;
+   a->zbuffer = in;
+   *pzout = zout;
+   return 1;
+}
 
+// returns 1 at the end of the block, or 2 to stop early (see stbi__zinflate)
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (STBI__ZBITS >= 64 && a->zbuffer_end - a->zbuffer >= (int) sizeof(stbi__zbits) && a->zout_end - zout >= 258)
+         if (!stbi__parse_huffman_fast(a, &zout)) return 0;
+      if (a->zsuspend) {
+         if ((a->zmore && a->zbuffer_end - a->zbuffer < STBI__ZMORE_SYMBOL) || (a->zout_pause && zout >= a->zout_pause)) {
+            a->zout = zout;
+            return 2;
+         }
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4374,7 +7506,7 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       int s = stbi__zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (stbi_uc) s;
    }
-   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19, NULL)) return 0;
 
    n = 0;
    while (n < ntot) {
@@ -4401,12 +7533,12 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit, a->z_length_wide)) return 0;
+   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, NULL)) return 0;
    return 1;
 }
 
-static int stbi__parse_uncompressed_block(stbi__zbuf *a)
+static int stbi__parse_uncompressed_header(stbi__zbuf *a)
 {
    stbi_uc header[4];
    int len,nlen,k;
@@ -4426,12 +7558,38 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
+   if (!a->refill && !a->zmore && a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   a->zstored = len;
+   return 1;
+}
+
+// returns 1 at the end of the block, or 2 to stop early (see stbi__zinflate)
+static int stbi__parse_uncompressed_block(stbi__zbuf *a)
+{
+   // with a refill hook, the block can span several input pieces
+   while (a->zstored > 0) {
+      int n = (int) (a->zbuffer_end - a->zbuffer);
+      if (a->zsuspend && a->zout_pause && a->zout >= a->zout_pause)
+         return 2;
+      if (n == 0) {
+         if (a->zmore) return 2;
+         if (stbi__zeof(a)) return stbi__err("read past buffer","Corrupt PNG");
+         continue;
+      }
+      if (n > a->zstored) n = a->zstored;
+      if (a->zsuspend && a->zout_pause && n > a->zout_pause - a->zout)
+         n = (int) (a->zout_pause - a->zout);
+      // stbi__parse_uncompressed_header made room for the whole block, but
+      // the output may have been flushed since, if stbi__zinflate stopped
+      if (a->zout + n > a->zout_end)
+         if (!stbi__zexpand(a, a->zout, n)) return 0;
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      a->zstored -= n;
+   }
    return 1;
 }
 
@@ -4445,7 +7603,7 @@ static int stbi__parse_zlib_header(stbi__zbuf *a)
    if ((cmf*256+flg) % 31 != 0) return stbi__err("bad zlib header","Corrupt PNG"); // zlib spec
    if (flg & 32) return stbi__err("no preset dict","Corrupt PNG"); // preset dictionary not allowed in png
    if (cm != 8) return stbi__err("bad compression","Corrupt PNG"); // DEFLATE required for png
-   // window = 1 << (8 + cinfo)... but who cares, we fully buffer output
+   // window = 1 << (8 + cinfo)... but who cares, we keep the largest window (32KB) anyway
    return 1;
 }
 
@@ -4478,33 +7636,73 @@ Init algorithm:
 }
 */
 
+// inflate from wherever the last call stopped; returns 1 at the end of the
+// stream, 0 on error, or 2 if it stopped early (only if zsuspend is set)
+static int stbi__zinflate(stbi__zbuf *a)
+{
+   int r, type;
+   for (;;) {
+      switch (a->zstate) {
+         case STBI__ZSTATE_header:
+            // (stbi__parse_zlib_header fails if there is nothing after it)
+            if (a->zsuspend && a->zmore && a->zbuffer_end - a->zbuffer < 3) return 2;
+            if (!stbi__parse_zlib_header(a)) return 0;
+            a->zstate = STBI__ZSTATE_block;
+            break;
+         case STBI__ZSTATE_block:
+            if (a->zfinal) {
+               a->zstate = STBI__ZSTATE_done;
+               break;
+            }
+            if (a->zsuspend && a->zmore && a->zbuffer_end - a->zbuffer < STBI__ZMORE_BLOCK) return 2;
+            a->zfinal = stbi__zreceive(a,1);
+            type = stbi__zreceive(a,2);
+            if (type == 0) {
+               if (!stbi__parse_uncompressed_header(a)) return 0;
+               a->zstate = STBI__ZSTATE_stored;
+            } else if (type == 3) {
+               return 0;
+            } else {
+               if (type == 1) {
+                  // use fixed code lengths
+                  if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS, a->z_length_wide)) return 0;
+                  if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32, NULL)) return 0;
+               } else {
+                  if (!stbi__compute_huffman_codes(a)) return 0;
+               }
+               a->zstate = STBI__ZSTATE_huffman;
+            }
+            break;
+         case STBI__ZSTATE_stored:
+         case STBI__ZSTATE_huffman:
+            r = a->zstate == STBI__ZSTATE_stored ? stbi__parse_uncompressed_block(a) : stbi__parse_huffman_block(a);
+            if (r != 1) return r;
+            a->zstate = STBI__ZSTATE_block;
+            break;
+         default:
+            return 1;
+      }
+   }
+}
+
+// start inflating; parse_header is 0 for a raw deflate stream
+static void stbi__zinflate_begin(stbi__zbuf *a, int parse_header)
+{
+   a->num_bits = 0;
+   a->code_buffer = 0;
+   a->hit_zeof_once = 0;
+   a->zstate = parse_header ? STBI__ZSTATE_header : STBI__ZSTATE_block;
+   a->zfinal = 0;
+   a->zstored = 0;
+   a->zsuspend = 0;
+   a->zmore = 0;
+   a->zout_pause = NULL;
+}
+
 static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 {
-   int final, type;
-   if (parse_header)
-      if (!stbi__parse_zlib_header(a)) return 0;
-   a->num_bits = 0;
-   a->code_buffer = 0;
-   a->hit_zeof_once = 0;
-   do {
-      final = stbi__zreceive(a,1);
-      type = stbi__zreceive(a,2);
-      if (type == 0) {
-         if (!stbi__parse_uncompressed_block(a)) return 0;
-      } else if (type == 3) {
-         return 0;
-      } else {
-         if (type == 1) {
-            // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
-         } else {
-            if (!stbi__compute_huffman_codes(a)) return 0;
-         }
-         if (!stbi__parse_huffman_block(a)) return 0;
-      }
-   } while (!final);
-   return 1;
+   stbi__zinflate_begin(a, parse_header);
+   return stbi__zinflate(a);
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -4513,6 +7711,9 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->refill = NULL;
+   a->flush = NULL;
+   a->zout_flushed = obuf;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4528,7 +7729,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4549,7 +7750,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4576,7 +7777,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4591,6 +7792,95 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
    else
       return -1;
 }
+
+// streaming inflate: the input is copied to zin a piece at a time, so that
+// stbi__zinflate can stop wherever it runs short and carry on next call,
+// and the output goes to the caller through the flush hook
+#define STBI__ZSTREAM_IN    65536
+#define STBI__ZSTREAM_OUT   (4*STBI__ZWINDOW)
+
+struct stbi_zlib_stream
+{
+   stbi__zbuf z;
+   stbi_uc zin[STBI__ZSTREAM_IN];
+   char *out;                 // the rest of the output piece
+   int out_left;
+   int done;                  // 1 at the end of the stream, -1 after an error
+};
+
+static int stbi__zstream_flush(void *user, stbi_uc *data, int len)
+{
+   stbi_zlib_stream *s = (stbi_zlib_stream *) user;
+   int n = len < s->out_left ? len : s->out_left;
+   if (n) {
+      memcpy(s->out, data, n);
+      s->out += n;
+      s->out_left -= n;
+   }
+   return n;
+}
+
+STBIDEF stbi_zlib_stream *stbi_zlib_stream_open(int parse_header)
+{
+   stbi_zlib_stream *s = (stbi_zlib_stream *) stbi__malloc(sizeof(*s));
+   stbi__zbuf *z;
+   if (!s) return (stbi_zlib_stream *) stbi__errpuc("outofmem", "Out of memory");
+   memset(s, 0, sizeof(*s));
+   z = &s->z;
+   z->zout_start = (char *) stbi__malloc(STBI__ZSTREAM_OUT);
+   if (!z->zout_start) {
+      stbi__free(s);
+      return (stbi_zlib_stream *) stbi__errpuc("outofmem", "Out of memory");
+   }
+   z->zout = z->zout_flushed = z->zout_start;
+   z->zout_end = z->zout_start + STBI__ZSTREAM_OUT;
+   z->z_expandable = 1; // just in case; the window slides down
+   z->zbuffer = z->zbuffer_end = s->zin;
+   z->refill = NULL;
+   z->flush = stbi__zstream_flush;
+   z->user = s;
+   stbi__zinflate_begin(z, parse_header);
+   z->zsuspend = 1;
+   return s;
+}
+
+STBIDEF int stbi_zlib_stream_inflate(stbi_zlib_stream *s, const char *in, int in_len, int *in_used, char *out, int out_len, int *out_written, int is_last)
+{
+   stbi__zbuf *z = &s->z;
+   int used = 0, have, n, r, stalled = 0;
+   s->out = out;
+   s->out_left = out_len;
+   for (;;) {
+      // pass on the output so far
+      stbi__zflush(z);
+      if (s->done || !s->out_left || stalled) break;
+      have = (int) (z->zbuffer_end - z->zbuffer);
+      if (have && z->zbuffer != s->zin) memmove(s->zin, z->zbuffer, have);
+      n = in_len - used < STBI__ZSTREAM_IN - have ? in_len - used : STBI__ZSTREAM_IN - have;
+      if (n) memcpy(s->zin + have, in + used, n);
+      used += n;
+      z->zbuffer = s->zin;
+      z->zbuffer_end = s->zin + have + n;
+      z->zmore = !is_last || used < in_len;
+      // and inflate little more than there is room for
+      z->zout_pause = z->zout_end - z->zout_flushed > s->out_left ? z->zout_flushed + s->out_left : z->zout_end;
+      r = stbi__zinflate(z);
+      if (r == 0) s->done = -1;
+      if (r == 1) s->done = 1;
+      stalled = r == 2 && z->zout < z->zout_pause && n == 0;
+   }
+   if (in_used) *in_used = used;
+   if (out_written) *out_written = out_len - s->out_left;
+   if (s->done < 0) return -1;
+   return s->done && z->zout == z->zout_flushed;
+}
+
+STBIDEF void stbi_zlib_stream_close(stbi_zlib_stream *s)
+{
+   if (!s) return;
+   stbi__free(s->z.zout_start);
+   stbi__free(s);
+}
 #endif
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
@@ -4627,13 +7917,65 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+// per-row versions of the passes stbi__parse_png_file makes over the whole
+// image, for streaming
+typedef struct
+{
+   stbi_uc *palette;
+   int pal_img_n;       // 0 if not paletted
+   int has_trans;
+   stbi_uc *tc;
+   stbi__uint16 *tc16;
+   int de_iphone;
+   int req_comp;
+   stbi_uc *row;        // scratch for palette expansion and 16-bit conversion
+   // region loads: rows y0..y1 (in file order) are expanded from pixel x0,
+   // a whole byte into the row, to x1 and passed on from pixel x0+skip;
+   // nothing past x1 is even unfiltered, as filters only look left and up
+   stbi__uint32 x0, x1, y0, y1, skip;
+   stbi__uint32 row_bytes;
+} stbi__png_rows;
+
 typedef struct
 {
    stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
+   stbi_uc *out;
    int depth;
+   stbi__png_rows *rows; // if set, out is a single row that's emitted as it's completed
+
+   // incremental decoding of the image data, see stbi__png_decode_idat
+   int out_n, color, interlace;
+   int pass, xorig, yorig, xspc, yspc;
+   stbi__uint32 pass_x, pass_y;  // size of the current pass; pass_y is 0 when done
+   stbi__uint32 row_y;           // next row in the pass
+   stbi__uint32 row_bytes;       // filtered bytes per row, not counting the filter type
+   stbi_uc *filter_buf;          // the current and previous unfiltered rows
+   stbi__uint32 filter_stride;
+   stbi_uc *pass_row;            // interlaced: one expanded row of the current pass
+   int simd;
+
+   stbi__uint32 idat_left;       // bytes left in the current IDAT chunk
+   int idat_gap;                 // stbi_push: idat_left is of a chunk between IDATs
+   stbi_uc *zin;                 // buffer for compressed data, if not reading from memory
+   stbi__pngchunk next;          // the chunk after the image data, if have_next
+   int have_next;
+   int read_error;
+
+   // resumable decoding (stbi_push): stbi__parse_png_file stops at the first
+   // IDAT chunk, ready to stream the rows with what they need from before
+   // the image data kept here, and to inflate into 'push'
+   stbi__zbuf *push;
+   stbi__png_rows stream;
+   stbi_uc palette[1024];
+   stbi_uc tc[3];
+   stbi__uint16 tc16[3];
 } stbi__png;
 
+#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+
+// how much compressed data to read at a time when not decoding from memory
+#define STBI__PNG_READ_SIZE 16384
+
 
 enum {
    STBI__F_none=0,
@@ -4667,6 +8009,226 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+// undo the filter on one scanline of nk bytes; prior is the previous
+// (already unfiltered) scanline, and isn't read for the first-row filters
+static void stbi__png_unfilter_row(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes)
+{
+   int k;
+   switch (filter) {
+   case STBI__F_none:
+      memcpy(cur, raw, nk);
+      break;
+   case STBI__F_sub:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+      break;
+   case STBI__F_up:
+      for (k = 0; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      break;
+   case STBI__F_avg:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
+      break;
+   case STBI__F_paeth:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
+      break;
+   case STBI__F_avg_first:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
+      break;
+   }
+}
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#define STBI__PNG_SIMD
+
+// Sub, Average and Paeth depend on the pixel to the left, so they can't be
+// vectorized along the row. Instead, these work on one whole pixel at a
+// time (3 or 4 channels, 8 or 16 bits each), which is where the scalar
+// loops spend most of their time. Up has no such dependency and is done
+// 16 bytes at a time.
+
+#ifdef STBI_SSE2
+// load/store the n-byte pixel at p, with 'left' bytes left in the row. while
+// there's room, these move 8 bytes; the extra lanes are never used, and the
+// extra bytes stored are overwritten by the following pixels
+static stbi_inline __m128i stbi__png_load_px(stbi_uc const *p, int n, int left)
+{
+   if (left >= 8) {
+      return _mm_loadl_epi64((__m128i const *) p);
+   } else {
+      stbi_uc tmp[8] = { 0 };
+      memcpy(tmp, p, n);
+      return _mm_loadl_epi64((__m128i const *) tmp);
+   }
+}
+
+static stbi_inline void stbi__png_store_px(stbi_uc *p, __m128i v, int n, int left)
+{
+   stbi_uc tmp[8];
+   if (left >= 8) {
+      _mm_storel_epi64((__m128i *) p, v);
+   } else {
+      _mm_storel_epi64((__m128i *) tmp, v);
+      memcpy(p, tmp, n);
+   }
+}
+
+static stbi_inline void stbi__png_unfilter_sse2(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero, b, x;
+   int k;
+
+   switch (filter) {
+   case STBI__F_sub:
+      for (k = 0; k < nk; k += n) {
+         a = _mm_add_epi8(stbi__png_load_px(raw+k, n, nk-k), a);
+         stbi__png_store_px(cur+k, a, n, nk-k);
+      }
+      break;
+   case STBI__F_up:
+      for (k = 0; k + 16 <= nk; k += 16) {
+         x = _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+k)), _mm_loadu_si128((__m128i const *) (prior+k)));
+         _mm_storeu_si128((__m128i *) (cur+k), x);
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      break;
+   case STBI__F_avg:
+      for (k = 0; k < nk; k += n) {
+         b = stbi__png_load_px(prior+k, n, nk-k);
+         // avg_epu8 rounds up, we need to round down
+         x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+         a = _mm_add_epi8(stbi__png_load_px(raw+k, n, nk-k), x);
+         stbi__png_store_px(cur+k, a, n, nk-k);
+      }
+      break;
+   case STBI__F_paeth:
+      // same formulation as stbi__paeth, on 16-bit lanes; the left pixel is
+      // carried in 16-bit form to keep the serial dependency chain short
+      a = c = zero;
+      for (k = 0; k < nk; k += n) {
+         __m128i b16, thresh, lo, hi, m0, m1, t1;
+         b16 = _mm_unpacklo_epi8(stbi__png_load_px(prior+k, n, nk-k), zero);
+         x = _mm_unpacklo_epi8(stbi__png_load_px(raw+k, n, nk-k), zero);
+         thresh = _mm_sub_epi16(_mm_sub_epi16(_mm_add_epi16(c, _mm_add_epi16(c, c)), b16), a);
+         lo = _mm_min_epi16(a, b16);
+         hi = _mm_max_epi16(a, b16);
+         m0 = _mm_cmpgt_epi16(hi, thresh); // t0 = m0 ? c : lo
+         m1 = _mm_cmpgt_epi16(thresh, lo); // t1 = m1 ? t0 : hi
+         t1 = _mm_xor_si128(_mm_xor_si128(hi, _mm_and_si128(_mm_xor_si128(hi, lo), m1)),
+                            _mm_and_si128(_mm_and_si128(_mm_xor_si128(lo, c), m0), m1));
+         a = _mm_and_si128(_mm_add_epi16(x, t1), _mm_set1_epi16(0xff));
+         c = b16;
+         stbi__png_store_px(cur+k, _mm_packus_epi16(a, a), n, nk-k);
+      }
+      break;
+   }
+}
+#endif
+
+#ifdef STBI_NEON
+// same as the SSE2 versions above
+static stbi_inline uint8x8_t stbi__png_load_px(stbi_uc const *p, int n, int left)
+{
+   if (left >= 8) {
+      return vld1_u8(p);
+   } else {
+      stbi_uc tmp[8] = { 0 };
+      memcpy(tmp, p, n);
+      return vld1_u8(tmp);
+   }
+}
+
+static stbi_inline void stbi__png_store_px(stbi_uc *p, uint8x8_t v, int n, int left)
+{
+   stbi_uc tmp[8];
+   if (left >= 8) {
+      vst1_u8(p, v);
+   } else {
+      vst1_u8(tmp, v);
+      memcpy(p, tmp, n);
+   }
+}
+
+static stbi_inline void stbi__png_unfilter_neon(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n)
+{
+   uint8x8_t a = vdup_n_u8(0), c = a, b;
+   int k;
+
+   switch (filter) {
+   case STBI__F_sub:
+      for (k = 0; k < nk; k += n) {
+         a = vadd_u8(stbi__png_load_px(raw+k, n, nk-k), a);
+         stbi__png_store_px(cur+k, a, n, nk-k);
+      }
+      break;
+   case STBI__F_up:
+      for (k = 0; k + 16 <= nk; k += 16)
+         vst1q_u8(cur+k, vaddq_u8(vld1q_u8(raw+k), vld1q_u8(prior+k)));
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      break;
+   case STBI__F_avg:
+      for (k = 0; k < nk; k += n) {
+         b = stbi__png_load_px(prior+k, n, nk-k);
+         a = vadd_u8(stbi__png_load_px(raw+k, n, nk-k), vhadd_u8(a, b));
+         stbi__png_store_px(cur+k, a, n, nk-k);
+      }
+      break;
+   case STBI__F_paeth:
+      for (k = 0; k < nk; k += n) {
+         uint8x8_t pa, pb, pc, use_a, use_b, pred;
+         b = stbi__png_load_px(prior+k, n, nk-k);
+         pa = vabd_u8(b, c);
+         pb = vabd_u8(a, c);
+         // |a+b-2c| can exceed 255; saturating it doesn't change the comparisons
+         pc = vqmovn_u16(vabdq_u16(vaddl_u8(a, b), vshll_n_u8(c, 1)));
+         use_a = vand_u8(vcle_u8(pa, pb), vcle_u8(pa, pc));
+         use_b = vcle_u8(pb, pc);
+         pred = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+         a = vadd_u8(stbi__png_load_px(raw+k, n, nk-k), pred);
+         c = b;
+         stbi__png_store_px(cur+k, a, n, nk-k);
+      }
+      break;
+   }
+}
+#endif
+
+// returns 0 if this row should go through the generic path instead
+static int stbi__png_unfilter_row_simd(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes)
+{
+   if (filter == STBI__F_none || filter == STBI__F_avg_first)
+      return 0;
+   // pass the pixel size as a constant, so the loads and stores get specialized
+   switch (filter_bytes) {
+#ifdef STBI_SSE2
+   case 3: stbi__png_unfilter_sse2(filter, cur, raw, prior, nk, 3); break;
+   case 4: stbi__png_unfilter_sse2(filter, cur, raw, prior, nk, 4); break;
+   case 6: stbi__png_unfilter_sse2(filter, cur, raw, prior, nk, 6); break;
+   case 8: stbi__png_unfilter_sse2(filter, cur, raw, prior, nk, 8); break;
+#else
+   case 3: stbi__png_unfilter_neon(filter, cur, raw, prior, nk, 3); break;
+   case 4: stbi__png_unfilter_neon(filter, cur, raw, prior, nk, 4); break;
+   case 6: stbi__png_unfilter_neon(filter, cur, raw, prior, nk, 6); break;
+   case 8: stbi__png_unfilter_neon(filter, cur, raw, prior, nk, 8); break;
+#endif
+   default: return 0;
+   }
+   return 1;
+}
+#endif // STBI_SSE2 || STBI_NEON
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4692,222 +8254,330 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
    }
 }
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
-{
-   int bytes = (depth == 16 ? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
-   stbi_uc *filter_buf;
-   int all_ok = 1;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
-
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
-
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
-
-   // note: error exits here don't need to clean up a->out individually,
-   // stbi__do_png always does on error.
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   if (!stbi__mad2sizes_valid(img_width_bytes, y, img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
-   img_len = (img_width_bytes + 1) * y;
-
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+static int stbi__png_emit_row(stbi__png *z, stbi_uc *row, stbi__uint32 y);
 
-   // Allocate two scan lines worth of filter workspace buffer.
-   filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 0);
-   if (!filter_buf) return stbi__err("outofmem", "Out of memory");
-
-   // Filtering for low-bit-depth images
+// expand an unfiltered row to 8 or 16 bits per channel, also adding an
+// extra alpha channel if desired
+static void stbi__png_expand_row(stbi_uc *dest, stbi_uc *cur, stbi__uint32 x, int img_n, int out_n, int depth, int color)
+{
+   stbi__uint32 i;
    if (depth < 8) {
-      filter_bytes = 1;
-      width = img_width_bytes;
-   }
-
-   for (j=0; j < y; ++j) {
-      // cur/prior filter buffers alternate
-      stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
-      stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
-      stbi_uc *dest = a->out + stride*j;
-      int nk = width * filter_bytes;
-      int filter = *raw++;
-
-      // check filter type
-      if (filter > 4) {
-         all_ok = stbi__err("invalid filter","Corrupt PNG");
-         break;
-      }
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // perform actual filtering
-      switch (filter) {
-      case STBI__F_none:
-         memcpy(cur, raw, nk);
-         break;
-      case STBI__F_sub:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
-         break;
-      case STBI__F_up:
-         for (k = 0; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
-         break;
-      case STBI__F_avg:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
-         break;
-      case STBI__F_paeth:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
-         break;
-      case STBI__F_avg_first:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
-         break;
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+      stbi_uc *in = cur;
+      stbi_uc *out = dest;
+      stbi_uc inb = 0;
+      stbi__uint32 nsmp = x*img_n;
+
+      // expand bits to bytes first
+      if (depth == 4) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 1) == 0) inb = *in++;
+            *out++ = scale * (inb >> 4);
+            inb <<= 4;
+         }
+      } else if (depth == 2) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 3) == 0) inb = *in++;
+            *out++ = scale * (inb >> 6);
+            inb <<= 2;
+         }
+      } else {
+         STBI_ASSERT(depth == 1);
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 7) == 0) inb = *in++;
+            *out++ = scale * (inb >> 7);
+            inb <<= 1;
+         }
       }
 
-      raw += nk;
-
-      // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
-      if (depth < 8) {
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-         stbi_uc *in = cur;
-         stbi_uc *out = dest;
-         stbi_uc inb = 0;
-         stbi__uint32 nsmp = x*img_n;
-
-         // expand bits to bytes first
-         if (depth == 4) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 1) == 0) inb = *in++;
-               *out++ = scale * (inb >> 4);
-               inb <<= 4;
-            }
-         } else if (depth == 2) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 3) == 0) inb = *in++;
-               *out++ = scale * (inb >> 6);
-               inb <<= 2;
+      // insert alpha=255 values if desired
+      if (img_n != out_n)
+         stbi__create_png_alpha_expand8(dest, dest, x, img_n);
+   } else if (depth == 8) {
+      if (img_n == out_n)
+         memcpy(dest, cur, x*img_n);
+      else
+         stbi__create_png_alpha_expand8(dest, cur, x, img_n);
+   } else if (depth == 16) {
+      // convert the image data from big-endian to platform-native
+      stbi__uint16 *dest16 = (stbi__uint16*)dest;
+      stbi__uint32 nsmp = x*img_n;
+
+      if (img_n == out_n) {
+         for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
+            *dest16 = (cur[0] << 8) | cur[1];
+      } else {
+         STBI_ASSERT(img_n+1 == out_n);
+         if (img_n == 1) {
+            for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = 0xffff;
             }
          } else {
-            STBI_ASSERT(depth == 1);
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 7) == 0) inb = *in++;
-               *out++ = scale * (inb >> 7);
-               inb <<= 1;
+            STBI_ASSERT(img_n == 3);
+            for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = (cur[2] << 8) | cur[3];
+               dest16[2] = (cur[4] << 8) | cur[5];
+               dest16[3] = 0xffff;
             }
          }
+      }
+   }
+}
 
-         // insert alpha=255 values if desired
-         if (img_n != out_n)
-            stbi__create_png_alpha_expand8(dest, dest, x, img_n);
-      } else if (depth == 8) {
-         if (img_n == out_n)
-            memcpy(dest, cur, x*img_n);
-         else
-            stbi__create_png_alpha_expand8(dest, cur, x, img_n);
-      } else if (depth == 16) {
-         // convert the image data from big-endian to platform-native
-         stbi__uint16 *dest16 = (stbi__uint16*)dest;
-         stbi__uint32 nsmp = x*img_n;
-
-         if (img_n == out_n) {
-            for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
-               *dest16 = (cur[0] << 8) | cur[1];
-         } else {
-            STBI_ASSERT(img_n+1 == out_n);
-            if (img_n == 1) {
-               for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = 0xffff;
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = (cur[2] << 8) | cur[3];
-                  dest16[2] = (cur[4] << 8) | cur[5];
-                  dest16[3] = 0xffff;
-               }
-            }
-         }
+// move on to the next non-empty interlace pass (or the whole image, if not
+// interlaced); returns 0 and clears pass_y if there are no more
+static int stbi__png_next_pass(stbi__png *a)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__context *s = a->s;
+   a->pass_y = 0;
+   a->row_y = 0;
+   while (++a->pass < (a->interlace ? 7 : 1)) {
+      if (a->interlace) {
+         int p = a->pass;
+         // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
+         a->pass_x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+         a->pass_y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+         a->xorig = xorig[p]; a->xspc = xspc[p];
+         a->yorig = yorig[p]; a->yspc = yspc[p];
+      } else {
+         a->pass_x = s->img_x;
+         a->pass_y = s->img_y;
+      }
+      if (a->pass_x && a->pass_y) {
+         a->row_bytes = ((s->img_n * a->pass_x * a->depth) + 7) >> 3;
+         return 1;
       }
+      a->pass_y = 0;
    }
+   return 0;
+}
 
-   STBI_FREE(filter_buf);
-   if (!all_ok) return 0;
+// unfilter one row of the current pass, and put it where it belongs
+static int stbi__png_unfilter_one(stbi__png *a, stbi_uc *raw)
+{
+   stbi__context *s = a->s;
+   int bytes = (a->depth == 16 ? 2 : 1);
+   int out_bytes = a->out_n * bytes;
+   stbi__uint32 j = a->row_y, i;
+   // cur/prior filter buffers alternate
+   stbi_uc *cur = a->filter_buf + (j & 1)*a->filter_stride;
+   stbi_uc *prior = a->filter_buf + (~j & 1)*a->filter_stride;
+   // filtering for low-bit-depth images is on whole bytes
+   int filter_bytes = a->depth < 8 ? 1 : s->img_n*bytes;
+   int nk = a->rows ? a->rows->row_bytes : a->row_bytes;
+   int filter = *raw++;
+
+   // check filter type
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
+
+   STBI__PROFILE_START(idct);
+   // perform actual filtering
+#ifdef STBI__PNG_SIMD
+   if (!a->simd || !stbi__png_unfilter_row_simd(filter, cur, raw, prior, nk, filter_bytes))
+#endif
+      stbi__png_unfilter_row(filter, cur, raw, prior, nk, filter_bytes);
+
+   if (a->interlace) {
+      // expand the pass row, then spread its pixels out over the image
+      stbi__uint32 out_y = j*a->yspc + a->yorig;
+      stbi_uc *dest;
+      if (s->flip) out_y = s->img_y-1 - out_y;
+      dest = a->out + ((size_t) out_y*s->img_x + a->xorig)*out_bytes;
+      stbi__png_expand_row(a->pass_row, cur, a->pass_x, s->img_n, a->out_n, a->depth, a->color);
+      for (i=0; i < a->pass_x; ++i)
+         memcpy(dest + (size_t) i*a->xspc*out_bytes, a->pass_row + (size_t) i*out_bytes, out_bytes);
+   } else if (a->rows) {
+      stbi__png_rows *r = a->rows;
+      if (j >= r->y0 && j < r->y1) {
+         stbi__png_expand_row(a->out, cur + ((r->x0 * s->img_n * a->depth) >> 3), r->x1 - r->x0, s->img_n, a->out_n, a->depth, a->color);
+         if (!stbi__png_emit_row(a, a->out, j))
+            return 0;
+      }
+   } else {
+      stbi_uc *dest = a->out + (size_t) s->img_x*out_bytes*(s->flip ? s->img_y-1 - j : j);
+      stbi__png_expand_row(dest, cur, a->pass_x, s->img_n, a->out_n, a->depth, a->color);
+   }
+   STBI__PROFILE_END(idct);
 
+   if (++a->row_y == a->pass_y)
+      stbi__png_next_pass(a);
    return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
-{
-   int bytes = (depth == 16 ? 2 : 1);
-   int out_bytes = out_n * bytes;
-   stbi_uc *final;
-   int p;
-   if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
-
-   // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
-   if (!final) return stbi__err("outofmem", "Out of memory");
-   for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
-      // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
-      if (x && y) {
-         stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j) {
-            for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                      a->out + (j*x+i)*out_bytes, out_bytes);
-            }
-         }
-         STBI_FREE(a->out);
-         image_data += img_len;
-         image_data_len -= img_len;
+// zlib flush hook: unfilter all the complete rows in the inflated data
+static int stbi__png_unfilter_rows(void *user, stbi_uc *raw, int len)
+{
+   stbi__png *a = (stbi__png *) user;
+   int used = 0;
+   // anything after the last row is ignored; issue #276 reported a PNG in
+   // the wild that had extra data at the end (all zeros)
+   while (a->pass_y && (stbi__uint32) (len - used) > a->row_bytes) {
+      int n = a->row_bytes + 1; // before we move on to the next pass
+      if (!stbi__png_unfilter_one(a, raw + used)) return -1;
+      used += n;
+   }
+   if (!a->pass_y) used = len;
+   return used;
+}
+
+// the spec wants the IDAT chunks to be consecutive, but we have always
+// accepted ancillary chunks between them (the chunk loop just skips those)
+static int stbi__png_idat_gap(stbi__pngchunk c)
+{
+   return (c.type & (1 << 29)) && c.type != STBI__PNG_TYPE('t','R','N','S');
+}
+
+// zlib refill hook: the next piece of this or a following IDAT chunk
+static int stbi__png_refill(stbi__zbuf *z)
+{
+   stbi__png *a = (stbi__png *) z->user;
+   stbi__context *s = a->s;
+   int n;
+   if (a->have_next || a->read_error) return 0;
+   while (a->idat_left == 0) {
+      stbi__pngchunk c;
+      stbi__get32be(s); // CRC
+      c = stbi__get_chunk_header(s);
+      if (stbi__png_idat_gap(c)) {
+         // the image data carries on after this chunk
+         stbi__skip(s, c.length);
+         continue;
+      }
+      if (c.type != STBI__PNG_TYPE('I','D','A','T')) {
+         // out of image data; the chunk loop carries on with this chunk
+         a->next = c;
+         a->have_next = 1;
+         return 0;
+      }
+      if (c.length > (1u << 30)) {
+         a->read_error = 2;
+         return 0;
       }
+      a->idat_left = c.length;
+   }
+   if (!stbi__io_callbacks(s)) {
+      // from memory, so no need to copy
+      n = (int) (s->img_buffer_end - s->img_buffer);
+      if ((stbi__uint32) n > a->idat_left) n = (int) a->idat_left;
+      z->zbuffer = s->img_buffer;
+      s->img_buffer += n;
+   } else {
+      n = a->idat_left < STBI__PNG_READ_SIZE ? (int) a->idat_left : STBI__PNG_READ_SIZE;
+      if (!stbi__getn(s, a->zin, n)) n = 0;
+      z->zbuffer = a->zin;
    }
-   a->out = final;
+   if (n == 0) {
+      a->read_error = 1;
+      return 0;
+   }
+   z->zbuffer_end = z->zbuffer + n;
+   a->idat_left -= n;
+   return 1;
+}
+
+// set up inflating and unfiltering the image data, starting with an IDAT
+// chunk of 'length' bytes. only a couple of rows and the deflate window are
+// buffered, the compressed data isn't collected first
+static int stbi__png_idat_begin(stbi__png *a, stbi__zbuf *z, stbi__uint32 length, int parse_header)
+{
+   stbi__context *s = a->s;
+   int bytes = (a->depth == 16 ? 2 : 1);
+   stbi__uint32 img_width_bytes, window;
 
+   z->zout_start = NULL;
+   STBI_ASSERT(a->out_n == s->img_n || a->out_n == s->img_n+1);
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, a->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   img_width_bytes = (((s->img_n * s->img_x * a->depth) + 7) >> 3);
+   if (!stbi__mad2sizes_valid(img_width_bytes, s->img_y, img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
+
+   // note: error exits here don't need to clean up a->out individually,
+   // stbi__do_png always does on error.
+   a->out = (stbi_uc *) stbi__malloc_mad3(s->img_x, a->rows ? 1 : s->img_y, a->out_n*bytes, 0);
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+
+   // two scan lines worth of filter workspace, enough for any pass
+   a->filter_stride = img_width_bytes;
+   a->filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 0);
+   if (a->interlace)
+      a->pass_row = (stbi_uc *) stbi__malloc_mad2(s->img_x, a->out_n*bytes, 0);
+   if (stbi__io_callbacks(s))
+      a->zin = (stbi_uc *) stbi__malloc(STBI__PNG_READ_SIZE);
+   // the inflate buffer needs the window, plus a partial row and room for
+   // new data (up to a whole stored block) after sliding down
+   window = img_width_bytes + 1 + 4*STBI__ZWINDOW;
+   z->zout_start = (char *) stbi__malloc(window);
+
+   if (!a->filter_buf || (a->interlace && !a->pass_row) || (stbi__io_callbacks(s) && !a->zin) || !z->zout_start)
+      return stbi__err("outofmem", "Out of memory");
+#ifdef STBI__PNG_SIMD
+#ifdef STBI_SSE2
+   a->simd = stbi__sse2_available();
+#else
+   a->simd = 1;
+#endif
+#endif
+   a->idat_left = length;
+   a->pass = -1;
+   stbi__png_next_pass(a);
+
+   z->zbuffer = z->zbuffer_end = NULL;
+   z->zout = z->zout_flushed = z->zout_start;
+   z->zout_end = z->zout_start + window;
+   z->z_expandable = 1;
+   z->refill = stbi__png_refill;
+   z->flush = stbi__png_unfilter_rows;
+   z->user = a;
+   stbi__zinflate_begin(z, parse_header);
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+// free what stbi__png_idat_begin allocated, apart from a->out
+static void stbi__png_idat_free(stbi__png *a, stbi__zbuf *z)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__free(z->zout_start); z->zout_start = NULL;
+   stbi__free(a->filter_buf); a->filter_buf = NULL;
+   stbi__free(a->pass_row);   a->pass_row = NULL;
+   stbi__free(a->zin);        a->zin = NULL;
+}
+
+// inflate and unfilter all of the image data. afterwards, either the rest
+// of the last IDAT chunk is skipped (up to its CRC), or the next chunk
+// header has already been read (a->have_next)
+static int stbi__png_decode_idat(stbi__png *a, stbi__uint32 length, int parse_header)
+{
+   stbi__zbuf z;
+   int ok = stbi__png_idat_begin(a, &z, length, parse_header);
+   if (ok) {
+      STBI__PROFILE_START(entropy);
+      ok = stbi__zinflate(&z) && stbi__zflush(&z);
+      STBI__PROFILE_END(entropy);
+      // if we ran out of data, that's the real reason zlib failed
+      if (a->read_error == 1)
+         ok = stbi__err("outofdata","Corrupt PNG");
+      else if (a->read_error == 2)
+         ok = stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+      else if (ok && a->pass_y)
+         ok = stbi__err("not enough pixels","Corrupt PNG");
+      if (ok && !a->have_next)
+         stbi__skip(a->s, (int) a->idat_left);
+   }
+   stbi__png_idat_free(a, &z);
+   return ok;
+}
+
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
+{
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4928,11 +8598,10 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi_uc *out, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
+   stbi__uint16 *p = (stbi__uint16*) out;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4953,17 +8622,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__expand_png_palette_pixels(stbi_uc *p, stbi_uc const *orig, stbi__uint32 pixel_count, stbi_uc *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4982,8 +8643,19 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
-   a->out = temp_out;
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *p;
+
+   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__expand_png_palette_pixels(p, a->out, pixel_count, palette, pal_img_n);
+   stbi__free(a->out);
+   a->out = p;
 
    STBI_NOTUSED(len);
 
@@ -5030,13 +8702,11 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
                                 : stbi__de_iphone_flag_global)
 #endif // STBI_THREAD_LOCAL
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -5044,7 +8714,7 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
+      STBI_ASSERT(out_n == 4);
       if (stbi__unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -5073,27 +8743,78 @@ static void stbi__de_iphone(stbi__png *z)
    }
 }
 
-#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+// streaming: finish one row the way stbi__parse_png_file and stbi__do_png
+// finish the whole image, and pass it on
+static int stbi__png_emit_row(stbi__png *z, stbi_uc *row, stbi__uint32 y)
+{
+   stbi__context *s = z->s;
+   stbi__png_rows *r = z->rows;
+   stbi__uint32 x = r->x1 - r->x0;
+   int n = s->img_out_n;
+
+   STBI__PROFILE_START(color);
+   if (r->has_trans) {
+      if (z->depth == 16)
+         stbi__compute_transparency16(row, x, r->tc16, n);
+      else
+         stbi__compute_transparency(row, x, r->tc, n);
+   }
+   if (r->de_iphone)
+      stbi__de_iphone(row, x, n);
+   STBI__PROFILE_END(color);
+   if (r->pal_img_n) {
+      n = r->req_comp >= 3 ? r->req_comp : r->pal_img_n;
+      STBI__PROFILE_START(color);
+      stbi__expand_png_palette_pixels(r->row, row, x, r->palette, n);
+      STBI__PROFILE_END(color);
+      row = r->row;
+   } else if (z->depth == 16) {
+      stbi__uint16 *wide = (stbi__uint16 *) row;
+      stbi__uint32 i;
+      if (r->req_comp && r->req_comp != n) {
+         if (!stbi__convert_row16((stbi__uint16 *) r->row, wide, n, r->req_comp, x))
+            return stbi__err("unsupported", "Unsupported format conversion");
+         n = r->req_comp;
+         wide = (stbi__uint16 *) r->row;
+         row = r->row;
+      }
+      // same as stbi__convert_16_to_8; fine to do in place
+      STBI__PROFILE_START(convert);
+      for (i=0; i < x * n; ++i)
+         row[i] = (stbi_uc) ((wide[i] >> 8) & 0xFF);
+      STBI__PROFILE_END(convert);
+   }
+   return stbi__rows_emit(s, row + r->skip * n, n, y, 1, x * n);
+}
 
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 i, pal_len=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, have_idat=0, streamed=0;
    stbi__context *s = z->s;
 
-   z->expanded = NULL;
-   z->idata = NULL;
+   z->rows = NULL;
    z->out = NULL;
+   z->filter_buf = z->pass_row = z->zin = NULL;
+   z->have_next = 0;
+   z->read_error = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
    if (scan == STBI__SCAN_type) return 1;
 
    for (;;) {
-      stbi__pngchunk c = stbi__get_chunk_header(s);
+      stbi__pngchunk c;
+      if (z->have_next) {
+         // already read while looking for more image data
+         c = z->next;
+         z->have_next = 0;
+      } else {
+         c = stbi__get_chunk_header(s);
+      }
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -5145,7 +8866,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (have_idat) return stbi__err("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
@@ -5180,47 +8901,98 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                return 1;
             }
             if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
-            if ((int)(ioff + c.length) < (int)ioff) return 0;
-            if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
-               stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
-               while (ioff + c.length > idata_limit)
-                  idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
-               z->idata = p;
+            if (have_idat) {
+               // more IDAT chunks after the end of the zlib stream
+               stbi__skip(s, c.length);
+               break;
+            }
+            have_idat = 1;
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+               s->img_out_n = s->img_n+1;
+            else
+               s->img_out_n = s->img_n;
+            z->out_n = s->img_out_n;
+            z->color = color;
+            z->interlace = interlace;
+            // stbi_push can only decode non-interlaced images a step at a time
+            if (z->push && interlace) return 1;
+            if (s->rows && !interlace) {
+               // streaming: rows are finished and passed on one at a time
+               stbi__png_rows r;
+               int ok;
+               r.palette = palette;
+               r.pal_img_n = pal_img_n;
+               r.has_trans = has_trans;
+               r.tc = tc;
+               r.tc16 = tc16;
+               r.de_iphone = is_iphone && stbi__de_iphone_flag && s->img_out_n > 2;
+               r.req_comp = req_comp;
+               r.x0 = r.skip = r.y0 = 0;
+               r.x1 = s->img_x;
+               r.y1 = s->img_y;
+               if (s->rows->mode == STBI__ROWS_region) {
+                  stbi__rows *rows = s->rows;
+                  if (!stbi__rows_region(s)) return 0;
+                  r.x0 = rows->rx0 & ~7;
+                  r.x1 = rows->rx0 + rows->rw;
+                  r.skip = rows->rx0 - r.x0;
+                  r.y0 = rows->flip ? s->img_y - (rows->ry0 + rows->rh) : (stbi__uint32) rows->ry0;
+                  r.y1 = r.y0 + rows->rh;
+                  rows->cropped = 1;
+               }
+               r.row_bytes = ((s->img_n * r.x1 * z->depth) + 7) >> 3;
+               r.row = (stbi_uc *) stbi__malloc_mad2(s->img_x, 8, 0);
+               if (!r.row) return stbi__err("outofmem", "Out of memory");
+               // report the channel count the code below would end up with
+               stbi__rows_begin(s, pal_img_n ? pal_img_n : s->img_n + has_trans);
+               if (z->push) {
+                  // keep what the rows need, and leave the rest to stbi__push_png
+                  memcpy(z->palette, palette, sizeof(palette));
+                  memcpy(z->tc, tc, sizeof(tc));
+                  memcpy(z->tc16, tc16, sizeof(tc16));
+                  z->stream = r;
+                  z->stream.palette = z->palette;
+                  z->stream.tc = z->tc;
+                  z->stream.tc16 = z->tc16;
+                  z->rows = &z->stream;
+                  return stbi__png_idat_begin(z, z->push, c.length, !is_iphone);
+               }
+               z->rows = &r;
+               ok = stbi__png_decode_idat(z, c.length, !is_iphone);
+               z->rows = NULL;
+               stbi__free(r.row);
+               stbi__free(z->out); z->out = NULL;
+               if (!ok) return 0;
+               streamed = 1;
+            } else {
+               if (!stbi__png_decode_idat(z, c.length, !is_iphone)) return 0;
             }
-            if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
-            ioff += c.length;
+            if (z->have_next) continue; // CRC and next chunk header already read
             break;
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
-            if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (!have_idat) return stbi__err("no IDAT","Corrupt PNG");
+            if (streamed) {
+               if (pal_img_n)
+                  s->img_n = pal_img_n;
+               else if (has_trans)
+                  ++s->img_n;
+               stbi__get32be(s);
+               return 1;
+            }
+            STBI__PROFILE_START(color);
             if (has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16(z->out, s->img_x * s->img_y, tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
                }
             }
             if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
@@ -5232,7 +9004,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            STBI__PROFILE_END(color);
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5263,17 +9035,22 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
 {
    void *result=NULL;
+   int ok;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
+   STBI__PROFILE_START(header);
+   ok = stbi__parse_png_file(p, STBI__SCAN_load, req_comp);
+   STBI__PROFILE_END(header);
+   if (ok) {
       if (p->depth <= 8)
          ri->bits_per_channel = 8;
       else if (p->depth == 16)
          ri->bits_per_channel = 16;
       else
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
-      result = p->out;
+      ri->flipped = p->s->flip; // stbi__png_unfilter_one stored the rows flipped
+      result = p->out; // NULL if streamed
       p->out = NULL;
-      if (req_comp && req_comp != p->s->img_out_n) {
+      if (result && req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
             result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          else
@@ -5285,9 +9062,7 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
 
    return result;
 }
@@ -5296,6 +9071,7 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
    stbi__png p;
    p.s = s;
+   p.push = NULL;
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
@@ -5323,6 +9099,7 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__png p;
    p.s = s;
+   p.push = NULL;
    return stbi__png_info_raw(&p, x, y, comp);
 }
 
@@ -5330,6 +9107,7 @@ static int stbi__png_is16(stbi__context *s)
 {
    stbi__png p;
    p.s = s;
+   p.push = NULL;
    if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
 	   return 0;
    if (p.depth != 16) {
@@ -5534,9 +9312,8 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    unsigned int mr=0,mg=0,mb=0,ma=0, all_a;
    stbi_uc pal[256][4];
    int psize=0,i,j,width;
-   int flip_vertically, pad, target;
+   int flip_vertically, pad, target, stream;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
@@ -5544,6 +9321,11 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    flip_vertically = ((int) s->img_y) > 0;
    s->img_y = abs((int) s->img_y);
+   // rows are stored where they belong, so flip on load is free
+   if (s->flip) {
+      flip_vertically = !flip_vertically;
+      ri->flipped = 1;
+   }
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
@@ -5594,11 +9376,20 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
       return stbi__errpuc("too large", "Corrupt BMP");
 
-   out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
+   // when streaming, decode one row at a time into 'out'; unless the alpha
+   // channel may turn out to be all 0s, which needs the whole image
+   stream = s->rows && !(target == 4 && all_a == 0);
+   if (stream) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n;
+   }
+
+   out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, stream ? 1 : s->img_y, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5610,11 +9401,12 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
             int bit_offset = 7, v = stbi__get8(s);
+            if (!stream) z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x*target;
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
                out[z++] = pal[color][0];
@@ -5628,9 +9420,14 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
                }
             }
             stbi__skip(s, pad);
+            if (stream) {
+               if (!stbi__rows_emit(s, out, target, flip_vertically ? (int) s->img_y-1-j : j, 1, s->img_x*target)) { stbi__free(out); return NULL; }
+               z = 0;
+            }
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            if (!stream) z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x*target;
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
@@ -5649,6 +9446,10 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
                if (target == 4) out[z++] = 255;
             }
             stbi__skip(s, pad);
+            if (stream) {
+               if (!stbi__rows_emit(s, out, target, flip_vertically ? (int) s->img_y-1-j : j, 1, s->img_x*target)) { stbi__free(out); return NULL; }
+               z = 0;
+            }
          }
       }
    } else {
@@ -5667,15 +9468,16 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         if (!stream) z = (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x*target;
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                unsigned char a;
@@ -5701,25 +9503,23 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             }
          }
          stbi__skip(s, pad);
+         if (stream) {
+            if (!stbi__rows_emit(s, out, target, flip_vertically ? (int) s->img_y-1-j : j, 1, s->img_x*target)) { stbi__free(out); return NULL; }
+            z = 0;
+         }
       }
    }
 
+   if (stream) {
+      stbi__free(out);
+      return NULL;
+   }
+
    // if alpha channel is all 0s, replace with all 255s
    if (target == 4 && all_a == 0)
       for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
          out[i] = 255;
 
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i]; p1[i] = p2[i]; p2[i] = t;
-         }
-      }
-   }
-
    if (req_comp && req_comp != target) {
       out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
@@ -5868,6 +9668,22 @@ static void stbi__tga_read_rgb16(stbi__context *s, stbi_uc* out)
    // so let's treat all 15 and 16bit TGAs as RGB with no alpha.
 }
 
+// streaming: swap RGB on one row as below, and pass it on
+static int stbi__tga_emit_row(stbi__context *s, stbi_uc *row, int tga_comp, int tga_rgb16, int y)
+{
+   if (tga_comp >= 3 && !tga_rgb16) {
+      stbi_uc *tga_pixel = row;
+      int i;
+      for (i=0; i < (int) s->img_x; ++i) {
+         unsigned char temp = tga_pixel[0];
+         tga_pixel[0] = tga_pixel[2];
+         tga_pixel[2] = temp;
+         tga_pixel += tga_comp;
+      }
+   }
+   return stbi__rows_emit(s, row, tga_comp, y, 1, s->img_x * tga_comp);
+}
+
 static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    //   read in the TGA header stuff
@@ -5887,14 +9703,13 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    int tga_inverted = stbi__get8(s);
    // int tga_alpha_bits = tga_inverted & 15; // the 4 lowest bits - unused (useless?)
    //   image data
-   unsigned char *tga_data;
+   unsigned char *tga_data, *tga_dst;
    unsigned char *tga_palette = NULL;
    int i, j;
    unsigned char raw_data[4] = {0};
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5908,6 +9723,11 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   // rows are stored where they belong, so flip on load is free
+   if (s->flip) {
+      tga_inverted = !tga_inverted;
+      ri->flipped = 1;
+   }
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);
@@ -5924,7 +9744,13 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad3sizes_valid(tga_width, tga_height, tga_comp, 0))
       return stbi__errpuc("too large", "Corrupt TGA");
 
-   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
+   // when streaming, decode one row at a time into tga_data
+   if (s->rows) {
+      s->img_x = tga_width;
+      s->img_y = tga_height;
+   }
+
+   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, s->rows ? 1 : tga_height, tga_comp, 0);
    if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
 
    // skip to the data's starting position (offset usually = 0)
@@ -5933,15 +9759,19 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
       for (i=0; i < tga_height; ++i) {
          int row = tga_inverted ? tga_height -i - 1 : i;
-         stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
+         stbi_uc *tga_row = tga_data + (s->rows ? 0 : row*tga_width*tga_comp);
          stbi__getn(s, tga_row, tga_width * tga_comp);
+         if (s->rows && !stbi__tga_emit_row(s, tga_row, tga_comp, tga_rgb16, row)) {
+            stbi__free(tga_data);
+            return NULL;
+         }
       }
    } else  {
       //   do I need to load a palette?
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
@@ -5950,7 +9780,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5961,14 +9791,20 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
       //   load the data
+      tga_dst = tga_data;
       for (i=0; i < tga_width * tga_height; ++i)
       {
+         //   start each row where it belongs
+         if (!s->rows && i % tga_width == 0) {
+            int row = i / tga_width;
+            tga_dst = tga_data + (tga_inverted ? tga_height - row - 1 : row) * tga_width * tga_comp;
+         }
          //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
          if ( tga_is_RLE )
          {
@@ -6018,35 +9854,35 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
          // copy data
          for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+           tga_dst[j] = raw_data[j];
+         tga_dst += tga_comp;
 
          //   in case we're in RLE mode, keep counting down
          --RLE_count;
-      }
-      //   do I need to invert the image?
-      if ( tga_inverted )
-      {
-         for (j = 0; j*2 < tga_height; ++j)
-         {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
+
+         //   when streaming, pass on each row as it's completed
+         if (s->rows && tga_dst == tga_data + tga_width*tga_comp) {
+            int row = i / tga_width;
+            if (!stbi__tga_emit_row(s, tga_data, tga_comp, tga_rgb16, tga_inverted ? tga_height - row - 1 : row)) {
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
+               return NULL;
             }
+            tga_dst = tga_data;
          }
       }
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
+   if (s->rows) {
+      stbi__free(tga_data);
+      return NULL;
+   }
+
    // swap RGB - if the source data was RGB16, it already is in the right order
    if (tga_comp >= 3 && !tga_rgb16)
    {
@@ -6235,7 +10071,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6527,7 +10363,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6555,6 +10391,7 @@ typedef struct
    stbi__int16 prefix;
    stbi_uc first;
    stbi_uc suffix;
+   stbi__uint16 length;  // of the whole string
 } stbi__gif_lzw;
 
 typedef struct
@@ -6575,6 +10412,9 @@ typedef struct
    int cur_x, cur_y;
    int line_size;
    int delay;
+   int frames;                   // number of frames decoded so far
+   stbi_uc block[255];           // the data sub-block being decoded
+   stbi_uc string[8192];         // a code's string, when it spans rows
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6641,59 +10481,100 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!g) return stbi__err("outofmem", "Out of memory");
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+static void stbi__out_gif_next_row(stbi__gif *g)
 {
-   stbi_uc *p, *c;
-   int idx;
-
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
-
-   if (g->cur_y >= g->max_y) return;
+   g->cur_x = g->start_x;
+   g->cur_y += g->step;
 
-   idx = g->cur_x + g->cur_y;
-   p = &g->out[idx];
-   g->history[idx / 4] = 1;
+   while (g->cur_y >= g->max_y && g->parse > 0) {
+      g->step = (1 << g->parse) * g->line_size;
+      g->cur_y = g->start_y + (g->step >> 1);
+      --g->parse;
+   }
+}
 
-   c = &g->color_table[g->codes[code].suffix * 4];
+static void stbi__out_gif_pixel(stbi__gif *g, stbi_uc *p, stbi_uc index)
+{
+   stbi_uc *c = &g->color_table[index * 4];
    if (c[3] > 128) { // don't render transparent pixels;
       p[0] = c[2];
       p[1] = c[1];
       p[2] = c[0];
       p[3] = c[3];
    }
-   g->cur_x += 4;
+}
+
+static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+{
+   int len = g->codes[code].length;
+   int idx, i, j, n;
 
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
+   if (g->cur_y >= g->max_y) return;
 
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
+   // the linked-list of prefixes is backwards, so the string is produced
+   // back to front. if it fits in the current row, that's fine: write it
+   // straight to the image
+   idx = g->cur_x + g->cur_y;
+   if (len <= (g->max_x - g->cur_x) >> 2) {
+      for (i = len-1; i >= 0; --i) {
+         g->history[idx / 4 + i] = 1;
+         stbi__out_gif_pixel(g, &g->out[idx + 4*i], g->codes[code].suffix);
+         code = g->codes[code].prefix;
       }
+      g->cur_x += 4 * len;
+      if (g->cur_x >= g->max_x)
+         stbi__out_gif_next_row(g);
+      return;
+   }
+
+   // otherwise (interlaced rows make working backwards through the image
+   // nasty) unpack it first, then write it out a row at a time
+   for (i = len-1; i >= 0; --i) {
+      g->string[i] = g->codes[code].suffix;
+      code = g->codes[code].prefix;
+   }
+   for (i = 0; i < len && g->cur_y < g->max_y; i += n) {
+      n = (g->max_x - g->cur_x) >> 2;
+      if (n > len - i) n = len - i;
+      idx = g->cur_x + g->cur_y;
+      memset(&g->history[idx / 4], 1, n);
+      for (j = 0; j < n; ++j)
+         stbi__out_gif_pixel(g, &g->out[idx + 4*j], g->string[i + j]);
+      g->cur_x += 4 * n;
+      if (g->cur_x >= g->max_x)
+         stbi__out_gif_next_row(g);
+   }
+}
+
+// read a data sub-block of length len
+static void stbi__gif_get_block(stbi__context *s, stbi__gif *g, int len)
+{
+   if (s->img_buffer_end - s->img_buffer >= len) {
+      memcpy(g->block, s->img_buffer, len);
+      s->img_buffer += len;
+   } else {
+      int i;
+      for (i = 0; i < len; ++i)
+         g->block[i] = stbi__get8(s);
    }
 }
 
 static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 {
    stbi_uc lzw_cs;
-   stbi__int32 len, init_code;
-   stbi__uint32 first;
-   stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
+   stbi__int32 len, pos, init_code;
+   stbi__uint32 first, bits;
+   stbi__int32 codesize, codemask, avail, oldcode, valid_bits, clear;
    stbi__gif_lzw *p;
 
    lzw_cs = stbi__get8(s);
@@ -6708,71 +10589,100 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
       g->codes[init_code].prefix = -1;
       g->codes[init_code].first = (stbi_uc) init_code;
       g->codes[init_code].suffix = (stbi_uc) init_code;
+      g->codes[init_code].length = 1;
    }
 
    // support no starting clear code
    avail = clear+2;
    oldcode = -1;
 
-   len = 0;
+   len = pos = 0;
    for(;;) {
+      stbi__int32 code;
       if (valid_bits < codesize) {
-         if (len == 0) {
+         if (pos == len) {
             len = stbi__get8(s); // start new block
             if (len == 0)
                return g->out;
+            stbi__gif_get_block(s, g, len);
+            pos = 0;
+         }
+         // codes are at most 12 bits, so top up as much as fits
+         do {
+            bits |= (stbi__uint32) g->block[pos++] << valid_bits;
+            valid_bits += 8;
+         } while (valid_bits <= 24 && pos < len);
+         if (valid_bits < codesize)
+            continue;
+      }
+      code = bits & codemask;
+      bits >>= codesize;
+      valid_bits -= codesize;
+      if (code == clear) {  // clear code
+         codesize = lzw_cs + 1;
+         codemask = (1 << codesize) - 1;
+         avail = clear + 2;
+         oldcode = -1;
+         first = 0;
+      } else if (code == clear + 1) { // end of stream code
+         while ((len = stbi__get8(s)) > 0)
+            stbi__skip(s,len);
+         return g->out;
+      } else if (code <= avail) {
+         if (first) {
+            return stbi__errpuc("no clear code", "Corrupt GIF");
          }
-         --len;
-         bits |= (stbi__int32) stbi__get8(s) << valid_bits;
-         valid_bits += 8;
-      } else {
-         stbi__int32 code = bits & codemask;
-         bits >>= codesize;
-         valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
-         if (code == clear) {  // clear code
-            codesize = lzw_cs + 1;
-            codemask = (1 << codesize) - 1;
-            avail = clear + 2;
-            oldcode = -1;
-            first = 0;
-         } else if (code == clear + 1) { // end of stream code
-            stbi__skip(s, len);
-            while ((len = stbi__get8(s)) > 0)
-               stbi__skip(s,len);
-            return g->out;
-         } else if (code <= avail) {
-            if (first) {
-               return stbi__errpuc("no clear code", "Corrupt GIF");
-            }
-
-            if (oldcode >= 0) {
-               p = &g->codes[avail++];
-               if (avail > 8192) {
-                  return stbi__errpuc("too many codes", "Corrupt GIF");
-               }
-
-               p->prefix = (stbi__int16) oldcode;
-               p->first = g->codes[oldcode].first;
-               p->suffix = (code == avail) ? p->first : g->codes[code].first;
-            } else if (code == avail)
-               return stbi__errpuc("illegal code in raster", "Corrupt GIF");
-
-            stbi__out_gif_code(g, (stbi__uint16) code);
 
-            if ((avail & codemask) == 0 && avail <= 0x0FFF) {
-               codesize++;
-               codemask = (1 << codesize) - 1;
+         if (oldcode >= 0) {
+            p = &g->codes[avail++];
+            if (avail > 8192) {
+               return stbi__errpuc("too many codes", "Corrupt GIF");
             }
 
-            oldcode = code;
-         } else {
+            p->prefix = (stbi__int16) oldcode;
+            p->first = g->codes[oldcode].first;
+            p->suffix = (code == avail) ? p->first : g->codes[code].first;
+            p->length = (stbi__uint16) (g->codes[oldcode].length + 1);
+         } else if (code == avail)
             return stbi__errpuc("illegal code in raster", "Corrupt GIF");
+
+         stbi__out_gif_code(g, (stbi__uint16) code);
+
+         if ((avail & codemask) == 0 && avail <= 0x0FFF) {
+            codesize++;
+            codemask = (1 << codesize) - 1;
          }
+
+         oldcode = code;
+      } else {
+         return stbi__errpuc("illegal code in raster", "Corrupt GIF");
       }
    }
 }
 
+// read the header and set up the frame buffers
+static int stbi__gif_begin(stbi__context *s, stbi__gif *g, int *comp)
+{
+   int pcount;
+   if (!stbi__gif_header(s, g, comp,0)) return 0; // stbi__g_failure_reason set by stbi__gif_header
+   if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
+      return stbi__err("too large", "GIF image is too large");
+   pcount = g->w * g->h;
+   g->out = (stbi_uc *) stbi__malloc(4 * pcount);
+   g->background = (stbi_uc *) stbi__malloc(4 * pcount);
+   g->history = (stbi_uc *) stbi__malloc(pcount);
+   if (!g->out || !g->background || !g->history)
+      return stbi__err("outofmem", "Out of memory");
+
+   // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
+   // background colour is only used for pixels that are not rendered first frame, after that "background"
+   // color refers to the color that was there the previous frame.
+   memset(g->out, 0x00, 4 * pcount);
+   memset(g->background, 0x00, 4 * pcount); // state of the background (starts transparent)
+   memset(g->history, 0x00, pcount);        // pixels that were affected previous frame
+   return 1;
+}
+
 // this function is designed to support animated gifs, although stb_image doesn't support it
 // two back is the image from two frames ago, used for a very specific disposal format
 static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp, stbi_uc *two_back)
@@ -6785,23 +10695,9 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
    // on first frame, any non-written pixels get the background colour (non-transparent)
    first_frame = 0;
-   if (g->out == 0) {
-      if (!stbi__gif_header(s, g, comp,0)) return 0; // stbi__g_failure_reason set by stbi__gif_header
-      if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
-         return stbi__errpuc("too large", "GIF image is too large");
-      pcount = g->w * g->h;
-      g->out = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->background = (stbi_uc *) stbi__malloc(4 * pcount);
-      g->history = (stbi_uc *) stbi__malloc(pcount);
-      if (!g->out || !g->background || !g->history)
-         return stbi__errpuc("outofmem", "Out of memory");
-
-      // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
-      // background colour is only used for pixels that are not rendered first frame, after that "background"
-      // color refers to the color that was there the previous frame.
-      memset(g->out, 0x00, 4 * pcount);
-      memset(g->background, 0x00, 4 * pcount); // state of the background (starts transparent)
-      memset(g->history, 0x00, pcount);        // pixels that were affected previous frame
+   if (g->out == 0 && !stbi__gif_begin(s, g, comp))
+      return 0;
+   if (g->frames == 0) {
       first_frame = 1;
    } else {
       // second frame - how do we dispose of the previous one?
@@ -6889,6 +10785,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
             o = stbi__process_gif_raster(s, g);
             if (!o) return NULL;
+            ++g->frames;
 
             // if this was the first frame,
             pcount = g->w * g->h;
@@ -6951,12 +10848,14 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
 static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__free(g->out);
+   stbi__free(g->history);
+   stbi__free(g->background);
+
+   stbi__free(g);
 
-   if (out) STBI_FREE(out);
-   if (delays && *delays) STBI_FREE(*delays);
+   if (out) stbi__free(out);
+   if (delays && *delays) stbi__free(*delays);
    return stbi__errpuc("outofmem", "Out of memory");
 }
 
@@ -6967,7 +10866,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       stbi_uc *u = 0;
       stbi_uc *out = 0;
       stbi_uc *two_back = 0;
-      stbi__gif g;
+      stbi__gif *g;
       int stride;
       int out_size = 0;
       int delays_size = 0;
@@ -6975,69 +10874,72 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       STBI_NOTUSED(out_size);
       STBI_NOTUSED(delays_size);
 
-      memset(&g, 0, sizeof(g));
+      g = (stbi__gif *) stbi__malloc(sizeof(stbi__gif));
+      if (!g) return stbi__errpuc("outofmem", "Out of memory");
+      memset(g, 0, sizeof(*g));
       if (delays) {
          *delays = 0;
       }
 
       do {
-         u = stbi__gif_load_next(s, &g, comp, req_comp, two_back);
+         u = stbi__gif_load_next(s, g, comp, req_comp, two_back);
          if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
 
          if (u) {
-            *x = g.w;
-            *y = g.h;
+            *x = g->w;
+            *y = g->h;
             ++layers;
-            stride = g.w * g.h * 4;
+            stride = g->w * g->h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized( out, out_size, layers * stride );
                if (!tmp)
-                  return stbi__load_gif_main_outofmem(&g, out, delays);
+                  return stbi__load_gif_main_outofmem(g, out, delays);
                else {
                    out = (stbi_uc*) tmp;
                    out_size = layers * stride;
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc_sized( *delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
-                     return stbi__load_gif_main_outofmem(&g, out, delays);
+                     return stbi__load_gif_main_outofmem(g, out, delays);
                   *delays = new_delays;
                   delays_size = layers * sizeof(int);
                }
             } else {
                out = (stbi_uc*)stbi__malloc( layers * stride );
                if (!out)
-                  return stbi__load_gif_main_outofmem(&g, out, delays);
+                  return stbi__load_gif_main_outofmem(g, out, delays);
                out_size = layers * stride;
                if (delays) {
                   *delays = (int*) stbi__malloc( layers * sizeof(int) );
                   if (!*delays)
-                     return stbi__load_gif_main_outofmem(&g, out, delays);
+                     return stbi__load_gif_main_outofmem(g, out, delays);
                   delays_size = layers * sizeof(int);
                }
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
-               (*delays)[layers - 1U] = g.delay;
+               (*delays)[layers - 1U] = g->delay;
             }
          }
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g->out);
+      stbi__free(g->history);
+      stbi__free(g->background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
-         out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
+         out = stbi__convert_format(out, 4, req_comp, layers * g->w, g->h);
 
+      stbi__free(g);
       *z = layers;
       return out;
    } else {
@@ -7048,28 +10950,30 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
 static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *u = 0;
-   stbi__gif g;
-   memset(&g, 0, sizeof(g));
+   stbi__gif *g = (stbi__gif *) stbi__malloc(sizeof(stbi__gif));
    STBI_NOTUSED(ri);
+   if (!g) return stbi__errpuc("outofmem", "Out of memory");
+   memset(g, 0, sizeof(*g));
 
-   u = stbi__gif_load_next(s, &g, comp, req_comp, 0);
+   u = stbi__gif_load_next(s, g, comp, req_comp, 0);
    if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
    if (u) {
-      *x = g.w;
-      *y = g.h;
+      *x = g->w;
+      *y = g->h;
 
       // moved conversion to after successful load so that the same
       // can be done for multiple frames.
       if (req_comp && req_comp != 4)
-         u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
-   } else if (g.out) {
+         u = stbi__convert_format(u, 4, req_comp, g->w, g->h);
+   } else if (g->out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g->out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g->history);
+   stbi__free(g->background);
+   stbi__free(g);
 
    return u;
 }
@@ -7078,6 +10982,149 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+// frame-at-a-time animated gif loading: instead of keeping every frame, keep
+// the last two (stbi__gif_load_next wants the one from two frames ago)
+struct stbi_gif_frames
+{
+   stbi__context s;
+   stbi__gif g;
+   stbi_uc *one_back, *two_back; // copies of the last two frames, once there are that many
+   stbi_uc *result;              // converted and/or flipped frame, if needed
+   int req_comp, flip;
+#ifndef STBI_NO_STDIO
+   FILE *f;                      // set if we opened it
+#endif
+};
+
+static void stbi__gif_frames_free(stbi_gif_frames *g)
+{
+#ifndef STBI_NO_STDIO
+   stbi__stop_file(&g->s);
+#endif
+   stbi__free(g->g.out);
+   stbi__free(g->g.history);
+   stbi__free(g->g.background);
+   stbi__free(g->one_back);
+   stbi__free(g->two_back);
+   stbi__free(g->result);
+   stbi__free(g);
+}
+
+// read the header of a gif set up in g->s
+static stbi_gif_frames *stbi__gif_frames_begin(stbi_gif_frames *g, int *x, int *y, int *comp, int req_comp)
+{
+   g->req_comp = req_comp;
+   g->flip = stbi__vertically_flip_on_load;
+   if (req_comp < 0 || req_comp > 4) {
+      stbi__err("bad req_comp", "Internal error");
+   } else if (!stbi__gif_test(&g->s)) {
+      stbi__err("not GIF", "Image was not as a gif type.");
+   } else if (stbi__gif_begin(&g->s, &g->g, comp)) {
+      if ((req_comp && req_comp != 4) || g->flip)
+         g->result = (stbi_uc *) stbi__malloc_mad3(req_comp ? req_comp : 4, g->g.w, g->g.h, 0);
+      if (g->result || !((req_comp && req_comp != 4) || g->flip)) {
+         *x = g->g.w;
+         *y = g->g.h;
+         return g;
+      }
+      stbi__err("outofmem", "Out of memory");
+   }
+   stbi__gif_frames_free(g);
+   return NULL;
+}
+
+static stbi_gif_frames *stbi__gif_frames_alloc(void)
+{
+   stbi_gif_frames *g = (stbi_gif_frames *) stbi__malloc(sizeof(*g));
+   if (g == NULL) return (stbi_gif_frames *) stbi__errpuc("outofmem", "Out of memory");
+   memset(g, 0, sizeof(*g));
+   return g;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *g = stbi__gif_frames_alloc();
+   if (g == NULL) return NULL;
+   stbi__start_mem(&g->s, buffer, len);
+   return stbi__gif_frames_begin(g, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *g = stbi__gif_frames_alloc();
+   if (g == NULL) return NULL;
+   stbi__start_callbacks(&g->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_frames_begin(g, x, y, comp, req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *g = stbi__gif_frames_alloc();
+   if (g == NULL) return NULL;
+   stbi__start_file(&g->s, f);
+   return stbi__gif_frames_begin(g, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_open(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_frames *g;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return (stbi_gif_frames *) stbi__errpuc("can't fopen", "Unable to open file");
+   g = stbi_gif_frames_from_file(f, x, y, comp, req_comp);
+   if (g)
+      g->f = f;
+   else
+      fclose(f);
+   return g;
+}
+#endif
+
+STBIDEF stbi_uc const *stbi_gif_frames_next(stbi_gif_frames *g, int *delay_in_ms)
+{
+   stbi_uc *u;
+   int j, n = g->req_comp ? g->req_comp : 4;
+   size_t size = (size_t) g->g.w * g->g.h * 4;
+
+   if (g->g.frames) {
+      // keep a copy of the current frame, the oldest one isn't needed any more
+      stbi_uc *t = g->two_back;
+      if (t == NULL) {
+         t = (stbi_uc *) stbi__malloc(size);
+         if (t == NULL) return stbi__errpuc("outofmem", "Out of memory");
+      }
+      memcpy(t, g->g.out, size);
+      g->two_back = g->one_back;
+      g->one_back = t;
+   }
+
+   u = stbi__gif_load_next(&g->s, &g->g, NULL, g->req_comp, g->g.frames >= 2 ? g->two_back : NULL);
+   if (u == NULL || u == (stbi_uc *) &g->s) return NULL;  // error, or end of animated gif marker
+   if (delay_in_ms) *delay_in_ms = g->g.delay;
+
+   if (g->result == NULL) return u;
+   for (j=0; j < g->g.h; ++j) {
+      stbi_uc *dest = g->result + (size_t) n * g->g.w * (g->flip ? g->g.h-1 - j : j);
+      if (n == 4)
+         memcpy(dest, u + (size_t) 4 * g->g.w * j, 4 * g->g.w);
+      else
+         stbi__convert_row(dest, u + (size_t) 4 * g->g.w * j, 4, n, g->g.w);
+   }
+   return g->result;
+}
+
+STBIDEF void stbi_gif_frames_close(stbi_gif_frames *g)
+{
+   if (g == NULL) return;
+#ifndef STBI_NO_STDIO
+   if (g->f)
+      fclose(g->f);
+   else if (g->s.io.read == stbi__stdio_read || g->s.file_map)
+      stbi__unget_file(&g->s);
+#endif
+   stbi__gif_frames_free(g);
+}
 #endif
 
 // *************************************************************************************************
@@ -7128,12 +11175,19 @@ static char *stbi__hdr_gettoken(stbi__context *z, char *buffer)
    return buffer;
 }
 
+// 2^(e-136), built directly rather than with ldexp(); exponents below 10
+// give denormals
+static stbi_inline float stbi__hdr_scale(int e)
+{
+   return stbi__bits_to_float(e >= 10 ? (stbi__uint32) (e - 9) << 23 : (stbi__uint32) 1 << (e + 13));
+}
+
 static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
    if ( input[3] != 0 ) {
       float f1;
       // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+      f1 = stbi__hdr_scale(input[3]);
       if (req_comp <= 2)
          output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
       else {
@@ -7155,6 +11209,73 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
+// convert a row of RGBE pixels. with 3 or 4 channels, the SIMD versions do
+// four pixels at a time, each stored as four floats; for 3 channels the
+// extra one is overwritten by the next pixel, so they stop one pixel early
+static void stbi__hdr_convert_row(float *output, stbi_uc *input, int width, int req_comp)
+{
+   int i = 0;
+#if defined(STBI_SSE2)
+   if (req_comp >= 3 && stbi__sse2_available()) {
+      __m128i zero = _mm_setzero_si128();
+      __m128 alpha = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+      __m128 one = _mm_set1_ps(1.0f);
+      int end = req_comp == 4 ? width : width - 1;
+      for (; i + 4 <= end; i += 4) {
+         __m128i px = _mm_loadu_si128((__m128i const *) (input + i*4));
+         __m128i lo = _mm_unpacklo_epi8(px, zero);
+         __m128i hi = _mm_unpackhi_epi8(px, zero);
+         __m128i e = _mm_srli_epi32(px, 24), scale;
+         __m128 f[4];
+         int k;
+         // denormal scales are rare; leave them to stbi__hdr_convert
+         if (_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi32(e, zero), _mm_cmplt_epi32(e, _mm_set1_epi32(10))))) {
+            for (k=0; k < 4; ++k)
+               stbi__hdr_convert(output + (i+k)*req_comp, input + (i+k)*4, req_comp);
+            continue;
+         }
+         // same as stbi__hdr_scale, with 0 for e == 0
+         scale = _mm_andnot_si128(_mm_cmpeq_epi32(e, zero), _mm_slli_epi32(_mm_sub_epi32(e, _mm_set1_epi32(9)), 23));
+         f[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), _mm_castsi128_ps(_mm_shuffle_epi32(scale, 0x00)));
+         f[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), _mm_castsi128_ps(_mm_shuffle_epi32(scale, 0x55)));
+         f[2] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), _mm_castsi128_ps(_mm_shuffle_epi32(scale, 0xaa)));
+         f[3] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), _mm_castsi128_ps(_mm_shuffle_epi32(scale, 0xff)));
+         for (k=0; k < 4; ++k)
+            _mm_storeu_ps(output + (i+k)*req_comp, _mm_or_ps(_mm_andnot_ps(alpha, f[k]), _mm_and_ps(alpha, one)));
+      }
+   }
+#elif defined(STBI_NEON)
+   if (req_comp >= 3) {
+      int end = req_comp == 4 ? width : width - 1;
+      for (; i + 4 <= end; i += 4) {
+         uint8x16_t px = vld1q_u8(input + i*4);
+         uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+         uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+         uint32x4_t e = vshrq_n_u32(vreinterpretq_u32_u8(px), 24), small;
+         uint32x2_t any;
+         float32x4_t scale, f[4];
+         int k;
+         small = vandq_u32(vcgtq_u32(e, vdupq_n_u32(0)), vcltq_u32(e, vdupq_n_u32(10)));
+         any = vorr_u32(vget_low_u32(small), vget_high_u32(small));
+         if (vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) {
+            for (k=0; k < 4; ++k)
+               stbi__hdr_convert(output + (i+k)*req_comp, input + (i+k)*4, req_comp);
+            continue;
+         }
+         scale = vreinterpretq_f32_u32(vbicq_u32(vshlq_n_u32(vsubq_u32(e, vdupq_n_u32(9)), 23), vceqq_u32(e, vdupq_n_u32(0))));
+         f[0] = vmulq_lane_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))),  vget_low_f32(scale), 0);
+         f[1] = vmulq_lane_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), vget_low_f32(scale), 1);
+         f[2] = vmulq_lane_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))),  vget_high_f32(scale), 0);
+         f[3] = vmulq_lane_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), vget_high_f32(scale), 1);
+         for (k=0; k < 4; ++k)
+            vst1q_f32(output + (i+k)*req_comp, vsetq_lane_f32(1.0f, f[k], 3));
+      }
+   }
+#endif
+   for (; i < width; ++i)
+      stbi__hdr_convert(output + i*req_comp, input + i*4, req_comp);
+}
+
 static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -7242,16 +11363,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
             scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
@@ -7265,22 +11386,21 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = value;
                } else {
                   // Dump
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = stbi__get8(s);
                }
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         stbi__hdr_convert_row(hdr_data + j*width*req_comp, scanline, width, req_comp);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
@@ -7522,10 +11642,50 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!stbi__mad4sizes_valid(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0))
       return stbi__errpuc("too large", "PNM too large");
 
+   if (s->rows) {
+      // streaming: read and pass on one row at a time
+      int bytes_per_row = s->img_n * s->img_x * (ri->bits_per_channel / 8);
+      stbi__uint16 *convert = NULL;
+      stbi__uint32 j;
+      out = (stbi_uc *) stbi__malloc(bytes_per_row);
+      if (!out) return stbi__errpuc("outofmem", "Out of memory");
+      if (ri->bits_per_channel == 16 && req_comp && req_comp != s->img_n) {
+         // convert before reducing to 8 bits, like the non-streaming path
+         convert = (stbi__uint16 *) stbi__malloc_mad3(req_comp, s->img_x, 2, 0);
+         if (!convert) { stbi__free(out); return stbi__errpuc("outofmem", "Out of memory"); }
+      }
+      for (j=0; j < s->img_y; ++j) {
+         stbi_uc *row = out;
+         int n = s->img_n;
+         if (!stbi__getn(s, out, bytes_per_row)) {
+            stbi__err("bad PNM", "PNM file truncated");
+            break;
+         }
+         if (ri->bits_per_channel == 16) {
+            // same reduction as stbi__convert_16_to_8, in place
+            stbi__uint32 i;
+            stbi__uint16 *wide = (stbi__uint16 *) out;
+            if (convert) {
+               stbi__convert_row16(convert, wide, n, req_comp, s->img_x);
+               wide = convert;
+               row = (stbi_uc *) convert;
+               n = req_comp;
+            }
+            for (i=0; i < s->img_x * n; ++i)
+               row[i] = (stbi_uc) ((wide[i] >> 8) & 0xFF);
+         }
+         if (!stbi__rows_emit(s, row, n, j, 1, n * s->img_x))
+            break;
+      }
+      stbi__free(convert);
+      stbi__free(out);
+      return NULL;
+   }
+
    out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (!stbi__getn(s, out, s->img_n * s->img_x * s->img_y * (ri->bits_per_channel / 8))) {
-      STBI_FREE(out);
+      stbi__free(out);
       return stbi__errpuc("bad PNM", "PNM file truncated");
    }
 
@@ -7705,6 +11865,7 @@ STBIDEF int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
    long pos = ftell(f);
    stbi__start_file(&s, f);
    r = stbi__info_main(&s,x,y,comp);
+   stbi__stop_file(&s);
    fseek(f,pos,SEEK_SET);
    return r;
 }
@@ -7726,6 +11887,7 @@ STBIDEF int stbi_is_16_bit_from_file(FILE *f)
    long pos = ftell(f);
    stbi__start_file(&s, f);
    r = stbi__is_16_main(&s);
+   stbi__stop_file(&s);
    fseek(f,pos,SEEK_SET);
    return r;
 }
@@ -7745,6 +11907,13 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
    return stbi__info_main(&s,x,y,comp);
 }
 
+STBIDEF int stbi_info_from_next_callbacks(stbi_io_next_callbacks const *c, void *user, int *x, int *y, int *comp)
+{
+   stbi__context s;
+   stbi__start_next_callbacks(&s, c, user);
+   return stbi__info_main(&s,x,y,comp);
+}
+
 STBIDEF int stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len)
 {
    stbi__context s;
@@ -7759,6 +11928,432 @@ STBIDEF int stbi_is_16_bit_from_callbacks(stbi_io_callbacks const *c, void *user
    return stbi__is_16_main(&s);
 }
 
+// resumable decoding (stbi_push_*). all the input so far is kept in one
+// buffer, which moves as it grows, so each step points a memory context at
+// it afresh and carries on from offset 'pos'. JPEGs and PNGs are started
+// over from the beginning until the headers are in; after that a step goes
+// on from where the last one stopped. everything else, and the JPEGs and
+// PNGs that can't be decoded in order, is left to the normal loader once
+// the input is complete
+
+// compressed PNG data to have at hand
+#define STBI__PUSH_ZIN  65536
+
+enum
+{
+   STBI__PUSH_start,             // don't know the format yet
+   STBI__PUSH_jpeg,
+   STBI__PUSH_png,
+   STBI__PUSH_whole              // load it in one go at the end
+};
+
+struct stbi_push
+{
+   stbi_uc *data;
+   int len, cap;
+   int last;                     // all the input is in
+   int wait;                     // len to wait for before the next try
+   int pos;                      // where the next step carries on
+   int req_comp;
+   int kind;                     // STBI__PUSH_*
+   int done;                     // STBI_PUSH_DONE or STBI_PUSH_ERROR once finished
+   int x, y, comp;
+   stbi_uc *image;
+   stbi__context s;
+   stbi__rows rows;
+#ifndef STBI_NO_JPEG
+   stbi__jpeg *jpeg;
+#endif
+#ifndef STBI_NO_PNG
+   stbi__png *png;
+   stbi__zbuf *z;
+   stbi_uc *zin;                 // IDAT contents, without the chunk framing
+#endif
+};
+
+STBIDEF stbi_push *stbi_push_open(int req_comp)
+{
+   stbi_push *p;
+   if (req_comp < 0 || req_comp > 4) return (stbi_push *) stbi__errpuc("bad req_comp", "Internal error");
+   p = (stbi_push *) stbi__malloc(sizeof(*p));
+   if (!p) return (stbi_push *) stbi__errpuc("outofmem", "Out of memory");
+   memset(p, 0, sizeof(*p));
+   p->req_comp = req_comp;
+   return p;
+}
+
+STBIDEF int stbi_push_data(stbi_push *p, stbi_uc const *data, int len, int is_last)
+{
+   if (len < 0) return stbi__err("bad len", "Internal error");
+   if (len > p->cap - p->len) {
+      int cap = p->cap ? p->cap : 4096;
+      stbi_uc *q;
+      while (len > cap - p->len) {
+         if (cap > INT_MAX / 2) return stbi__err("too large", "Image file too large");
+         cap *= 2;
+      }
+      q = (stbi_uc *) stbi__realloc_sized(p->data, p->cap, cap);
+      if (!q) return stbi__err("outofmem", "Out of memory");
+      p->data = q;
+      p->cap = cap;
+   }
+   if (len) memcpy(p->data + p->len, data, len);
+   p->len += len;
+   if (is_last) p->last = 1;
+   return 1;
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// destination for the rows of JPEGs and PNGs: the whole image, allocated
+// once the size is known
+static void stbi__push_rows(stbi_push *p)
+{
+   stbi__rows *r = &p->rows;
+   memset(r, 0, sizeof(*r));
+   r->mode = STBI__ROWS_alloc;
+   r->req_comp = p->req_comp;
+   r->flip = stbi__vertically_flip_on_load;
+   r->x = &p->x;
+   r->y = &p->y;
+   r->comp = &p->comp;
+   p->s.rows = r;
+}
+#endif
+
+static int stbi__push_whole(stbi_push *p)
+{
+   p->kind = STBI__PUSH_whole;
+   if (!p->last) return STBI_PUSH_NEED_DATA;
+   stbi__start_mem(&p->s, p->data, p->len);
+   p->image = stbi__load_and_postprocess_8bit(&p->s, &p->x, &p->y, &p->comp, p->req_comp);
+   return p->image ? STBI_PUSH_DONE : STBI_PUSH_ERROR;
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// a step that ran out of input after starting at offset 'from' is only
+// tried again once half as much again has come in, so that data passed in
+// small pieces isn't decoded over and over
+static int stbi__push_starved(stbi_push *p, int from)
+{
+   int more = (p->len - from) / 2;
+   if (more < 1) more = 1;
+   p->wait = p->len > INT_MAX - more ? INT_MAX : p->len + more;
+   return STBI_PUSH_NEED_DATA;
+}
+
+// the JPEG and PNG steps finish with all the rows in p->rows.dest
+static int stbi__push_finish(stbi_push *p)
+{
+   if (p->rows.rows_done != (stbi__uint32) p->y) {
+      stbi__err("not enough pixels", "Corrupt image");
+      return STBI_PUSH_ERROR;
+   }
+   p->image = p->rows.dest;
+   p->rows.dest = NULL;
+   return STBI_PUSH_DONE;
+}
+#endif
+
+#ifndef STBI_NO_JPEG
+// baseline JPEGs stop at the end of an iMCU row, once the budget is used up
+// or when the next row might need data that has not come in yet; in that
+// case the row is decoded again, from stbi__jpeg::mark, once there is more
+static int stbi__push_jpeg(stbi_push *p, int budget)
+{
+   stbi__jpeg *z = p->jpeg;
+   int fresh = z->mark.row < 0, ok;
+   if (fresh) {
+      memset(z, 0, sizeof(*z));
+      z->s = &p->s;
+      stbi__setup_jpeg(z);
+      stbi__jpeg_setup_downscale(z);
+      z->stream = 1;
+      z->req_comp = p->req_comp;
+      z->push = 1;
+      z->mark.row = -1;
+      p->s.img_n = 0; // make stbi__cleanup_jpeg safe
+      p->s.img_buffer = p->s.img_buffer_original;
+      stbi__push_rows(p);
+   } else {
+      p->s.rows = &p->rows;
+   }
+   z->push_more = !p->last;
+   z->push_budget = budget;
+   ok = fresh ? stbi__decode_jpeg_image(z) : stbi__parse_entropy_coded_data(z);
+   if (stbi__jpeg_push_starved(z)) {
+      if (z->mark.row >= 0) {
+         stbi__jpeg_push_restore(z);
+         return stbi__push_starved(p, z->mark.pos);
+      }
+      stbi__cleanup_jpeg(z); // try the headers again with more data
+      p->pos = 0;
+      return stbi__push_starved(p, 0);
+   }
+   if (!ok) return STBI_PUSH_ERROR;
+   if (z->mark.row < 0) {
+      // progressive, or scans that cannot be streamed
+      stbi__cleanup_jpeg(z);
+      return stbi__push_whole(p);
+   }
+   if (z->push_paused) {
+      z->push_paused = 0;
+      return STBI_PUSH_IN_PROGRESS;
+   }
+   // the end of the scan: pass on the remaining rows, and ignore the rest
+   // of the file like stbi__decode_jpeg_image does
+   if (!stbi__jpeg_stream_rows(z, z->img_mcu_y * z->img_v_max * z->idct_size, NULL)) return STBI_PUSH_ERROR;
+   return stbi__push_finish(p);
+}
+#endif
+
+#ifndef STBI_NO_PNG
+// free what a PNG header attempt or the image data left allocated
+static void stbi__push_png_free(stbi__png *a)
+{
+   if (a->rows) {
+      stbi__free(a->rows->row);
+      a->rows = NULL;
+      stbi__png_idat_free(a, a->push);
+   }
+   stbi__free(a->out);
+   a->out = NULL;
+}
+
+// move the image data that has come in to p->zin, without the chunk
+// framing, for stbi__zinflate; clears zmore at the end of the data. returns
+// 1 if there is anything new for the inflater, 0 if not, -1 on error
+static int stbi__push_png_input(stbi_push *p)
+{
+   stbi__png *a = p->png;
+   stbi__zbuf *z = p->z;
+   stbi__context *s = &p->s;
+   int have = (int) (z->zbuffer_end - z->zbuffer), got = 0, n;
+   if (have && z->zbuffer != p->zin) memmove(p->zin, z->zbuffer, have);
+   z->zbuffer = p->zin;
+   while (z->zmore && have < STBI__PUSH_ZIN) {
+      n = (int) (s->img_buffer_end - s->img_buffer);
+      if (a->idat_left == 0) {
+         // the CRC, then the next chunk header
+         stbi__pngchunk c;
+         if (n < 12) {
+            if (!p->last) break;
+            c.type = 0;
+         } else {
+            stbi__skip(s, 4);
+            c = stbi__get_chunk_header(s);
+         }
+         a->idat_gap = stbi__png_idat_gap(c);
+         if (a->idat_gap) {
+            a->idat_left = c.length;
+            continue;
+         }
+         if (c.type != STBI__PNG_TYPE('I','D','A','T')) {
+            z->zmore = 0;
+            got = 1;
+            break;
+         }
+         if (c.length > (1u << 30)) {
+            stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+            return -1;
+         }
+         a->idat_left = c.length;
+         continue;
+      }
+      if (n == 0) {
+         if (p->last) {
+            z->zmore = 0;
+            got = 1;
+         }
+         break;
+      }
+      if ((stbi__uint32) n > a->idat_left) n = (int) a->idat_left;
+      if (a->idat_gap) {
+         s->img_buffer += n;
+         a->idat_left -= n;
+         continue;
+      }
+      if (n > STBI__PUSH_ZIN - have) n = STBI__PUSH_ZIN - have;
+      memcpy(p->zin + have, s->img_buffer, n);
+      s->img_buffer += n;
+      a->idat_left -= n;
+      have += n;
+      got = 1;
+   }
+   z->zbuffer_end = p->zin + have;
+   return got;
+}
+
+// non-interlaced PNGs inflate until enough rows for the budget have been
+// passed on, or until the compressed data runs short (see stbi__zinflate)
+static int stbi__push_png(stbi_push *p, int budget)
+{
+   stbi__png *a = p->png;
+   stbi__zbuf *z = p->z;
+   stbi__uint32 target, need, room;
+   int r, stalled = 0;
+   if (!a->rows) {
+      memset(a, 0, sizeof(*a));
+      memset(z, 0, sizeof(*z));
+      a->s = &p->s;
+      a->push = z;
+      p->s.img_buffer = p->s.img_buffer_original;
+      stbi__push_rows(p);
+      r = stbi__parse_png_file(a, STBI__SCAN_load, p->req_comp);
+      if (!p->last && p->s.img_buffer >= p->s.img_buffer_end) {
+         stbi__push_png_free(a); // try the headers again with more data
+         p->pos = 0;
+         return stbi__push_starved(p, 0);
+      }
+      if (!r) return STBI_PUSH_ERROR;
+      if (!a->rows) {
+         // interlaced
+         stbi__push_png_free(a);
+         return stbi__push_whole(p);
+      }
+      z->zsuspend = 1;
+      z->zmore = 1;
+      z->refill = NULL;
+   }
+   p->s.rows = &p->rows;
+   target = p->rows.rows_done + (budget / p->x ? budget / p->x : 1);
+   for (;;) {
+      int got = stbi__push_png_input(p);
+      if (got < 0) return STBI_PUSH_ERROR;
+      if (stalled && !got) return stbi__push_starved(p, p->len);
+      // stop once the output has the rows still to go, or the buffer is full
+      room = (stbi__uint32) (z->zout_end - z->zout_flushed);
+      need = target - p->rows.rows_done;
+      need = need > room / (a->row_bytes+1) ? room : need * (a->row_bytes+1);
+      z->zout_pause = z->zout_flushed + need;
+      r = stbi__zinflate(z);
+      stalled = r == 2 && z->zout < z->zout_pause;
+      if (!r || !stbi__zflush(z)) return STBI_PUSH_ERROR;
+      if (r == 1) {
+         if (a->pass_y) {
+            stbi__err("not enough pixels", "Corrupt PNG");
+            return STBI_PUSH_ERROR;
+         }
+         return stbi__push_finish(p);
+      }
+      if (p->rows.rows_done >= target) return STBI_PUSH_IN_PROGRESS;
+   }
+}
+#endif
+
+// free everything but the input and the finished image
+static void stbi__push_free(stbi_push *p)
+{
+#ifndef STBI_NO_JPEG
+   if (p->jpeg) {
+      stbi__cleanup_jpeg(p->jpeg);
+      stbi__free(p->jpeg);
+      p->jpeg = NULL;
+   }
+#endif
+#ifndef STBI_NO_PNG
+   if (p->png) {
+      stbi__push_png_free(p->png);
+      stbi__free(p->png);
+      p->png = NULL;
+   }
+   stbi__free(p->z);
+   stbi__free(p->zin);
+   p->z = NULL;
+   p->zin = NULL;
+#endif
+   stbi__free(p->rows.dest);
+   stbi__free(p->rows.convert);
+   p->rows.dest = p->rows.convert = NULL;
+}
+
+STBIDEF int stbi_push_decode(stbi_push *p, int budget)
+{
+   int r;
+   if (p->done) return p->done;
+   if (p->len < p->wait && !p->last) return STBI_PUSH_NEED_DATA;
+   if (budget <= 0) budget = INT_MAX;
+   stbi__start_mem(&p->s, p->data, p->len);
+   p->s.img_buffer += p->pos;
+
+   if (p->kind == STBI__PUSH_start) {
+      if (p->len < 8 && !p->last) return STBI_PUSH_NEED_DATA;
+      p->kind = STBI__PUSH_whole;
+#ifndef STBI_NO_PNG
+      if (stbi__png_test(&p->s)) {
+         p->png = (stbi__png *) stbi__malloc(sizeof(stbi__png));
+         p->z = (stbi__zbuf *) stbi__malloc(sizeof(stbi__zbuf));
+         p->zin = (stbi_uc *) stbi__malloc(STBI__PUSH_ZIN);
+         if (!p->png || !p->z || !p->zin) {
+            stbi__err("outofmem", "Out of memory");
+            p->done = STBI_PUSH_ERROR;
+            return p->done;
+         }
+         memset(p->png, 0, sizeof(stbi__png));
+         memset(p->z, 0, sizeof(stbi__zbuf));
+         p->kind = STBI__PUSH_png;
+      }
+#endif
+#ifndef STBI_NO_JPEG
+      if (p->kind == STBI__PUSH_whole && stbi__jpeg_test(&p->s)) {
+         p->jpeg = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+         if (!p->jpeg) {
+            stbi__err("outofmem", "Out of memory");
+            p->done = STBI_PUSH_ERROR;
+            return p->done;
+         }
+         memset(p->jpeg, 0, sizeof(stbi__jpeg));
+         p->jpeg->s = &p->s;
+         p->jpeg->mark.row = -1;
+         p->kind = STBI__PUSH_jpeg;
+      }
+#endif
+   }
+
+   switch (p->kind) {
+#ifndef STBI_NO_JPEG
+      case STBI__PUSH_jpeg: r = stbi__push_jpeg(p, budget); break;
+#endif
+#ifndef STBI_NO_PNG
+      case STBI__PUSH_png:  r = stbi__push_png(p, budget); break;
+#endif
+      default:              r = stbi__push_whole(p); break;
+   }
+   if (p->kind != STBI__PUSH_whole)
+      p->pos = (int) (p->s.img_buffer - p->s.img_buffer_original);
+   if (r == STBI_PUSH_DONE || r == STBI_PUSH_ERROR) {
+      p->done = r;
+      stbi__push_free(p);
+   }
+   return r;
+}
+
+STBIDEF int stbi_push_info(stbi_push *p, int *x, int *y, int *comp)
+{
+   if (!p->x) return 0;
+   if (x) *x = p->x;
+   if (y) *y = p->y;
+   if (comp) *comp = p->comp;
+   return 1;
+}
+
+STBIDEF stbi_uc *stbi_push_image(stbi_push *p, int *x, int *y, int *comp)
+{
+   stbi_uc *image = p->image;
+   if (!image) return NULL;
+   p->image = NULL;
+   stbi_push_info(p, x, y, comp);
+   return image;
+}
+
+STBIDEF void stbi_push_close(stbi_push *p)
+{
+   if (!p) return;
+   stbi__push_free(p);
+   stbi__free(p->image);
+   stbi__free(p->data);
+   stbi__free(p);
+}
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*
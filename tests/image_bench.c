@@ -0,0 +1,488 @@
+// Decode benchmark for stb_image. Loads every image of a corpus from memory,
+// many times over, and prints the speed of each format as JSON. The corpus
+// is pngsuite/ plus large images generated at startup: JPEG (4:2:0 and
+// 4:4:4), PNG (RGB and RGBA), GIF, HDR, PSD, TGA and BMP.
+//
+//    cd tests
+//    make bench
+//
+// or by hand, for the SIMD paths (SSE2 or NEON, whichever the target has)
+// and the scalar ones:
+//
+//    cc -O2 -I.. image_bench.c -lm -o image_bench
+//    cc -O2 -I.. -DSTBI_NO_SIMD image_bench.c -lm -o image_bench_scalar
+//    ./image_bench [iterations [runs]] > bench_simd.json
+//
+// Each format is timed decoding all of its files 'iterations' times (default
+// 10), and the fastest of 'runs' such timings (default 5) is reported.
+// mb_per_s counts the bytes of the files, mp_per_s the pixels decoded. A
+// format that fails to decode (say, compiled out with STBI_NO_GIF) gets an
+// "error" instead of timings, and the exit code is 1. The generated images
+// are the same every time, and the output has the same layout every time,
+// so results from different builds or stb releases can be compared line by
+// line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#define WIN32 // what stb.h checks
+#pragma comment(lib, "advapi32.lib")
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define STB_DEFINE
+#include "deprecated/stb.h"
+
+#define BENCH_W        2048
+#define BENCH_H        1536
+#define BENCH_MAX_FILES 256
+
+typedef struct
+{
+   const char *format;
+   stbi_uc *data[BENCH_MAX_FILES];
+   int len[BENCH_MAX_FILES];
+   int count;
+} bench_set;
+
+static double now(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER t, f;
+   QueryPerformanceCounter(&t);
+   QueryPerformanceFrequency(&f);
+   return (double) t.QuadPart / (double) f.QuadPart;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+static void add_file(bench_set *set, stbi_uc *data, int len)
+{
+   if (set->count == BENCH_MAX_FILES) {
+      free(data);
+      return;
+   }
+   set->data[set->count] = data;
+   set->len[set->count] = len;
+   ++set->count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// generated corpus
+//
+
+static unsigned int seed = 12345;
+
+static int rnd(int n)
+{
+   seed = seed * 1664525 + 1013904223;
+   return (int) ((seed >> 8) % (unsigned int) n);
+}
+
+static stbi_uc clamp255(double v)
+{
+   return (stbi_uc) (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// something photo-like: smooth gradients, a few edges and a little noise,
+// so the encoders compress it about as well as a real picture
+static stbi_uc *make_image(int w, int h, int comp)
+{
+   stbi_uc *p = (stbi_uc *) malloc((size_t) w * h * comp);
+   int x, y, k;
+   seed = 12345;
+   for (y=0; y < h; ++y) {
+      for (x=0; x < w; ++x) {
+         stbi_uc *q = p + ((size_t) y * w + x) * comp;
+         double u = (double) x / w, v = (double) y / h;
+         double base = 110 + 60*sin(u*7 + v*3) + 40*cos(v*11 - u*2);
+         double detail = 18*sin(x*0.9 + 3*v)*cos(y*0.7 - 2*u);
+         int edge = ((x / 160) + (y / 120)) & 1 ? 25 : -25;
+         for (k=0; k < comp; ++k) {
+            if (k == 3)
+               q[k] = clamp255(255 - 90*u*v + rnd(5));
+            else
+               q[k] = clamp255(base + edge + detail + 35*sin(u*(5+k*3) - v*(2+k)) + rnd(17) - 8);
+         }
+      }
+   }
+   return p;
+}
+
+typedef struct
+{
+   stbi_uc *data;
+   int len, size;
+} membuf;
+
+static void write_func(void *context, void *data, int size)
+{
+   membuf *m = (membuf *) context;
+   if (m->len + size > m->size) {
+      m->size = (m->len + size) * 2;
+      m->data = (stbi_uc *) realloc(m->data, m->size);
+   }
+   memcpy(m->data + m->len, data, size);
+   m->len += size;
+}
+
+static void put8(membuf *m, int v)
+{
+   stbi_uc c = (stbi_uc) v;
+   write_func(m, &c, 1);
+}
+
+static void put16be(membuf *m, int v) { put8(m, v >> 8); put8(m, v); }
+static void put32be(membuf *m, int v) { put16be(m, v >> 16); put16be(m, v); }
+static void put16le(membuf *m, int v) { put8(m, v); put8(m, v >> 8); }
+
+// PSD: RGB, 8 bits per channel, PackBits compressed as Photoshop writes it
+static int packbits(stbi_uc *out, stbi_uc const *in, int n)
+{
+   int i = 0, o = 0;
+   while (i < n) {
+      int run = 1;
+      while (i + run < n && run < 128 && in[i+run] == in[i]) ++run;
+      if (run >= 3) {
+         out[o++] = (stbi_uc) (257 - run);
+         out[o++] = in[i];
+         i += run;
+      } else {
+         // literals, up to where a run of 3 starts
+         int lit = 0;
+         while (i + lit < n && lit < 128 && !(i + lit + 2 < n && in[i+lit] == in[i+lit+1] && in[i+lit] == in[i+lit+2]))
+            ++lit;
+         out[o++] = (stbi_uc) (lit - 1);
+         memcpy(out + o, in + i, lit);
+         o += lit;
+         i += lit;
+      }
+   }
+   return o;
+}
+
+static void write_psd(membuf *m, stbi_uc const *pixels, int w, int h)
+{
+   stbi_uc *plane = (stbi_uc *) malloc(w);
+   stbi_uc *rle = (stbi_uc *) malloc(w + w/128 + 2);
+   int x, y, c, pass;
+
+   write_func(m, "8BPS", 4);
+   put16be(m, 1);
+   put32be(m, 0); put16be(m, 0); // reserved
+   put16be(m, 3);
+   put32be(m, h);
+   put32be(m, w);
+   put16be(m, 8);
+   put16be(m, 3); // RGB
+   put32be(m, 0); // color mode data
+   put32be(m, 0); // image resources
+   put32be(m, 0); // layer and mask info
+   put16be(m, 1); // RLE
+
+   // the row byte counts come first, so compress everything twice
+   for (pass=0; pass < 2; ++pass) {
+      for (c=0; c < 3; ++c) {
+         for (y=0; y < h; ++y) {
+            int n;
+            for (x=0; x < w; ++x)
+               plane[x] = pixels[((size_t) y*w + x)*3 + c];
+            n = packbits(rle, plane, w);
+            if (pass == 0)
+               put16be(m, n);
+            else
+               write_func(m, rle, n);
+         }
+      }
+   }
+   free(rle);
+   free(plane);
+}
+
+// GIF: 3-3-2 palette, LZW compressed
+static unsigned short gif_tree[4096][256];
+
+typedef struct
+{
+   membuf *m;
+   stbi_uc block[255];
+   int block_len;
+   unsigned int bits;
+   int num_bits;
+} gif_writer;
+
+static void gif_byte(gif_writer *g, int b)
+{
+   g->block[g->block_len++] = (stbi_uc) b;
+   if (g->block_len == 255) {
+      put8(g->m, 255);
+      write_func(g->m, g->block, 255);
+      g->block_len = 0;
+   }
+}
+
+static void gif_code(gif_writer *g, int code, int size)
+{
+   g->bits |= (unsigned int) code << g->num_bits;
+   g->num_bits += size;
+   while (g->num_bits >= 8) {
+      gif_byte(g, g->bits & 255);
+      g->bits >>= 8;
+      g->num_bits -= 8;
+   }
+}
+
+static void write_gif(membuf *m, stbi_uc const *pixels, int w, int h)
+{
+   gif_writer g;
+   int i, n = w * h, cur = -1, size = 9, max_code = 257;
+
+   write_func(m, "GIF89a", 6);
+   put16le(m, w);
+   put16le(m, h);
+   put8(m, 0xf7); // global color table of 256 entries
+   put8(m, 0);
+   put8(m, 0);
+   for (i=0; i < 256; ++i) {
+      put8(m, (i >> 5) * 255 / 7);
+      put8(m, ((i >> 2) & 7) * 255 / 7);
+      put8(m, (i & 3) * 255 / 3);
+   }
+   put8(m, 0x2c);
+   put16le(m, 0); put16le(m, 0);
+   put16le(m, w); put16le(m, h);
+   put8(m, 0);
+   put8(m, 8); // LZW minimum code size
+
+   memset(&g, 0, sizeof(g));
+   g.m = m;
+   memset(gif_tree, 0, sizeof(gif_tree));
+   gif_code(&g, 256, size);
+   for (i=0; i < n; ++i) {
+      stbi_uc const *p = pixels + (size_t) i*3;
+      int c = (p[0] & 0xe0) | ((p[1] >> 3) & 0x1c) | (p[2] >> 6);
+      if (cur < 0) {
+         cur = c;
+      } else if (gif_tree[cur][c]) {
+         cur = gif_tree[cur][c];
+      } else {
+         gif_code(&g, cur, size);
+         gif_tree[cur][c] = (unsigned short) ++max_code;
+         if (max_code >= (1 << size))
+            ++size;
+         if (max_code == 4095) {
+            gif_code(&g, 256, size);
+            memset(gif_tree, 0, sizeof(gif_tree));
+            size = 9;
+            max_code = 257;
+         }
+         cur = c;
+      }
+   }
+   gif_code(&g, cur, size);
+   gif_code(&g, 257, size);
+   if (g.num_bits)
+      gif_byte(&g, g.bits);
+   if (g.block_len) {
+      put8(m, g.block_len);
+      write_func(m, g.block, g.block_len);
+   }
+   put8(m, 0);
+   put8(m, 0x3b);
+}
+
+enum { GEN_jpeg_420, GEN_jpeg_444, GEN_png, GEN_png_rgba, GEN_gif, GEN_hdr, GEN_psd, GEN_tga, GEN_bmp };
+
+static void generate(bench_set *set, int kind, stbi_uc const *rgb, stbi_uc const *rgba, int w, int h)
+{
+   membuf m;
+   memset(&m, 0, sizeof(m));
+   switch (kind) {
+      case GEN_jpeg_420: stbi_write_jpg_to_func(write_func, &m, w, h, 3, rgb, 75); break; // quality <= 90 subsamples
+      case GEN_jpeg_444: stbi_write_jpg_to_func(write_func, &m, w, h, 3, rgb, 95); break;
+      case GEN_png:      stbi_write_png_to_func(write_func, &m, w, h, 3, rgb, w*3); break;
+      case GEN_png_rgba: stbi_write_png_to_func(write_func, &m, w, h, 4, rgba, w*4); break;
+      case GEN_gif:      write_gif(&m, rgb, w, h); break;
+      case GEN_psd:      write_psd(&m, rgb, w, h); break;
+      case GEN_tga:      stbi_write_tga_to_func(write_func, &m, w, h, 3, rgb); break;
+      case GEN_bmp:      stbi_write_bmp_to_func(write_func, &m, w, h, 3, rgb); break;
+      case GEN_hdr: {
+         float *f = (float *) malloc(sizeof(float) * w * h * 3);
+         int i;
+         for (i=0; i < w*h*3; ++i)
+            f[i] = rgb[i] * rgb[i] / 4096.0f; // up to ~16, like a bright scene
+         stbi_write_hdr_to_func(write_func, &m, w, h, 3, f);
+         free(f);
+         break;
+      }
+   }
+   add_file(set, m.data, m.len);
+}
+
+static int load_pngsuite(bench_set *set)
+{
+   char **files = stb_readdir_recursive("pngsuite", "*.png");
+   int i;
+   if (!files)
+      return 0;
+   qsort(files, stb_arr_len(files), sizeof(char*), stb_qsort_strcmp(0));
+   for (i=0; i < stb_arr_len(files); ++i) {
+      size_t len;
+      int x, y, n;
+      stbi_uc *file = (stbi_uc *) stb_file(files[i], &len);
+      stbi_uc *pixels;
+      if (!file) continue;
+      // leave out the ones that are meant to fail (pngsuite/corrupt)
+      pixels = stbi_load_from_memory(file, (int) len, &x, &y, &n, 0);
+      if (!pixels) {
+         free(file);
+         continue;
+      }
+      stbi_image_free(pixels);
+      add_file(set, file, (int) len);
+   }
+   stb_readdir_free(files);
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// timing
+//
+
+// decode every file of the set once; returns the number of pixels, or -1
+static double decode_set(bench_set *set)
+{
+   double pixels = 0;
+   int i;
+   for (i=0; i < set->count; ++i) {
+      int x, y, n;
+      stbi_uc *p = stbi_load_from_memory(set->data[i], set->len[i], &x, &y, &n, 0);
+      if (!p)
+         return -1;
+      stbi_image_free(p);
+      pixels += (double) x * y;
+   }
+   return pixels;
+}
+
+// failure reasons can include bytes from the file (an unknown PNG chunk
+// name), so escape them
+static void print_json_string(const char *str)
+{
+   putchar('"');
+   for (; *str; ++str) {
+      unsigned char c = (unsigned char) *str;
+      if (c == '"' || c == '\\')
+         printf("\\%c", c);
+      else if (c < 32 || c >= 127)
+         printf("\\u%04x", c);
+      else
+         putchar(c);
+   }
+   putchar('"');
+}
+
+// prints one entry of the "results" array; a format that fails to decode
+// still gets one, with an "error" field instead of the timings
+static int bench(bench_set *set, int iterations, int runs, int first)
+{
+   double bytes = 0, pixels, best = 0;
+   int i, r;
+   for (i=0; i < set->count; ++i)
+      bytes += set->len[i];
+   printf("%s    { \"format\": \"%s\", \"files\": %d, \"bytes\": %.0f, ", first ? "" : ",\n", set->format, set->count, bytes);
+   pixels = set->count ? decode_set(set) : -1; // also warms up the caches
+   if (pixels < 0) {
+      const char *why = set->count ? stbi_failure_reason() : "no files";
+      fprintf(stderr, "%s: %s\n", set->format, why);
+      printf("\"error\": ");
+      print_json_string(why);
+      printf(" }");
+      return 0;
+   }
+   for (r=0; r < runs; ++r) {
+      double t = now();
+      for (i=0; i < iterations; ++i)
+         decode_set(set);
+      t = (now() - t) / iterations;
+      if (r == 0 || t < best)
+         best = t;
+   }
+   printf("\"pixels\": %.0f, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"mp_per_s\": %.2f }",
+          pixels, best, bytes / best / 1e6, pixels / best / 1e6);
+   return 1;
+}
+
+int main(int argc, char **argv)
+{
+   static const char *names[] = { "jpeg_420", "jpeg_444", "png", "png_rgba", "gif", "hdr", "psd", "tga", "bmp" };
+   static bench_set sets[10];
+   int iterations = argc > 1 ? atoi(argv[1]) : 10;
+   int runs = argc > 2 ? atoi(argv[2]) : 5;
+   int i, num_sets = 0, ok = 1;
+   stbi_uc *rgb, *rgba;
+   const char *simd =
+#if defined(STBI_AVX2)
+      "sse2+avx2";
+#elif defined(STBI_SSE2)
+      "sse2";
+#elif defined(STBI_NEON)
+      "neon";
+#else
+      "none";
+#endif
+
+   if (iterations < 1) iterations = 1;
+   if (runs < 1) runs = 1;
+
+   sets[num_sets].format = "pngsuite";
+   if (!load_pngsuite(&sets[num_sets])) {
+      fprintf(stderr, "pngsuite files not found!\n");
+      return 1;
+   }
+   ++num_sets;
+
+   rgb  = make_image(BENCH_W, BENCH_H, 3);
+   rgba = make_image(BENCH_W, BENCH_H, 4);
+   for (i=0; i < (int) (sizeof(names) / sizeof(names[0])); ++i) {
+      sets[num_sets].format = names[i];
+      generate(&sets[num_sets++], i, rgb, rgba, BENCH_W, BENCH_H);
+   }
+   free(rgb);
+   free(rgba);
+
+   printf("{\n");
+   printf("  \"simd\": \"%s\",\n", simd);
+   printf("  \"iterations\": %d,\n", iterations);
+   printf("  \"runs\": %d,\n", runs);
+   printf("  \"results\": [\n");
+   for (i=0; i < num_sets; ++i)
+      ok &= bench(&sets[i], iterations, runs, i == 0);
+   printf("\n  ]\n");
+   printf("}\n");
+
+   for (i=0; i < num_sets; ++i) {
+      int k;
+      for (k=0; k < sets[i].count; ++k)
+         free(sets[i].data[k]);
+   }
+   return ok ? 0 : 1;
+}
+
+// vim:sw=3:sts=3:et
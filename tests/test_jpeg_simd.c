@@ -0,0 +1,135 @@
+// Checks that the SIMD JPEG kernels (IDCT, h2v2 chroma upsampling, YCbCr
+// to RGB) produce exactly the same output as the generic C versions.
+//
+//    cc -O2 -I.. test_jpeg_simd.c -lm -o test_jpeg_simd
+//    cc -O2 -I.. -mavx2 -DSTBI_AVX2 test_jpeg_simd.c -lm -o test_jpeg_simd
+//
+// With STBI_NO_SIMD (or on a target without SIMD kernels) there is nothing
+// to compare, and the test just passes.
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#include "stb_image.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+
+static unsigned int seed = 12345;
+
+static int rnd(int n)
+{
+   seed = seed * 1664525 + 1013904223;
+   return (int) ((seed >> 8) % (unsigned int) n);
+}
+
+// mix of typical blocks: sparse, DC only, and dense dequantized coefficients.
+// kind 4 is arbitrary 16-bit input, which can overflow the 16-bit adds in
+// the SIMD kernels, so it's only used to compare SIMD kernels with each other
+static void make_block(short data[64], int kind)
+{
+   int i;
+   for (i=0; i < 64; ++i) {
+      int range = (i == 0) ? 2048 : 1024 / (1 + (i>>3) + (i&7));
+      data[i] = 0;
+      if (kind == 0 && rnd(4) != 0) continue;
+      if (kind == 1 && i != 0) continue;
+      if (kind == 3) range = 512;
+      if (kind == 4) range = 32767;
+      data[i] = (short) (rnd(2*range+1) - range);
+   }
+}
+
+typedef void idct_func(stbi_uc *out, int out_stride, short data[64]);
+
+static int check_idct(const char *name, idct_func *ref_idct, idct_func *idct, int kinds)
+{
+   int n;
+   for (n=0; n < 200000; ++n) {
+      STBI_SIMD_ALIGN(short, data[64]);
+      STBI_SIMD_ALIGN(short, copy[64]);
+      stbi_uc ref[8*8], out[8*8];
+
+      make_block(data, n % kinds);
+      memcpy(copy, data, sizeof(copy));
+
+      ref_idct(ref, 8, data);
+      idct(out, 8, copy);
+      if (memcmp(ref, out, sizeof(ref)) != 0) {
+         printf("%s: mismatch on block %d\n", name, n);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static int check_resample(void)
+{
+   int n, w, i;
+   for (n=0; n < 20000; ++n) {
+      stbi_uc near_row[200], far_row[200], ref[400], out[400];
+      w = 1 + rnd(199);
+      for (i=0; i < 200; ++i) {
+         near_row[i] = (stbi_uc) rnd(256);
+         far_row[i] = (stbi_uc) rnd(256);
+      }
+      stbi__resample_row_hv_2(ref, near_row, far_row, w, 2);
+      stbi__resample_row_hv_2_simd(out, near_row, far_row, w, 2);
+      if (memcmp(ref, out, w*2) != 0) {
+         printf("resample_row_hv_2: mismatch at width %d\n", w);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static int check_ycbcr(void)
+{
+   int n, count, i;
+   for (n=0; n < 20000; ++n) {
+      stbi_uc y[200], cb[200], cr[200], ref[800], out[800];
+      count = 1 + rnd(199);
+      for (i=0; i < 200; ++i) {
+         y[i] = (stbi_uc) rnd(256);
+         cb[i] = (stbi_uc) rnd(256);
+         cr[i] = (stbi_uc) rnd(256);
+      }
+      stbi__YCbCr_to_RGB_row(ref, y, cb, cr, count, 4);
+      stbi__YCbCr_to_RGB_simd(out, y, cb, cr, count, 4);
+      if (memcmp(ref, out, count*4) != 0) {
+         printf("YCbCr_to_RGB: mismatch at count %d\n", count);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+int main(void)
+{
+   int errors = 0;
+   errors += check_idct("idct_simd", stbi__idct_block, stbi__idct_simd, 4);
+#ifdef STBI_AVX2
+   errors += check_idct("idct_avx2", stbi__idct_block, stbi__idct_avx2, 4);
+   errors += check_idct("idct_avx2 vs sse2", stbi__idct_simd, stbi__idct_avx2, 5);
+   printf("(avx2 kernels enabled)\n");
+#endif
+   errors += check_resample();
+   errors += check_ycbcr();
+   if (errors)
+      return 1;
+   printf("all ok!\n");
+   return 0;
+}
+
+#else
+
+int main(void)
+{
+   printf("no SIMD kernels in this build, nothing to check\n");
+   return 0;
+}
+
+#endif
+
+// vim:sw=3:sts=3:et
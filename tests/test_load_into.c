@@ -0,0 +1,156 @@
+// Checks that the stbi_load_into* functions reject bad destinations (NULL,
+// zero or negative stride and height, too small) with a 0 return instead of
+// writing anywhere, and still decode into a good one.
+//
+//    cd tests
+//    cc -O2 -I.. test_load_into.c -lm -o test_load_into
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define W 37
+#define H 21
+
+typedef struct
+{
+   unsigned char data[65536];
+   int len;
+} mem_file;
+
+static void write_mem(void *context, void *data, int size)
+{
+   mem_file *m = (mem_file *) context;
+   if (m->len + size <= (int) sizeof(m->data)) {
+      memcpy(m->data + m->len, data, size);
+      m->len += size;
+   }
+}
+
+typedef struct
+{
+   stbi_uc const *data;
+   int len, pos;
+} mem_reader;
+
+static int read_mem(void *user, char *data, int size)
+{
+   mem_reader *r = (mem_reader *) user;
+   if (size > r->len - r->pos) size = r->len - r->pos;
+   memcpy(data, r->data + r->pos, size);
+   r->pos += size;
+   return size;
+}
+
+static void skip_mem(void *user, int n)
+{
+   ((mem_reader *) user)->pos += n;
+}
+
+static int eof_mem(void *user)
+{
+   mem_reader *r = (mem_reader *) user;
+   return r->pos >= r->len;
+}
+
+static stbi_io_callbacks callbacks = { read_mem, skip_mem, eof_mem };
+
+static int errors;
+
+static void expect(int ok, char const *what, char const *name)
+{
+   if (!ok) {
+      printf("%s: %s\n", name, what);
+      ++errors;
+   }
+}
+
+// one bad destination, through every entry point that takes memory or callbacks
+static void check_bad(mem_file *f, char const *name, stbi_uc *out, int stride, int height)
+{
+   int x, y, n, r;
+   mem_reader m;
+   stbi_jpeg_decoder *d;
+
+   r = stbi_load_into_from_memory(f->data, f->len, &x, &y, &n, 3, out, stride, height);
+   expect(r == 0, "stbi_load_into_from_memory accepted a bad destination", name);
+
+   m.data = f->data; m.len = f->len; m.pos = 0;
+   r = stbi_load_into_from_callbacks(&callbacks, &m, &x, &y, &n, 3, out, stride, height);
+   expect(r == 0, "stbi_load_into_from_callbacks accepted a bad destination", name);
+
+   d = stbi_jpeg_decoder_create();
+   r = stbi_jpeg_decoder_load_into(d, f->data, f->len, &x, &y, &n, 3, out, stride, height);
+   expect(r == 0, "stbi_jpeg_decoder_load_into accepted a bad destination", name);
+   stbi_jpeg_decoder_free(d);
+}
+
+static void check_file(mem_file *f, char const *name, int is_jpeg)
+{
+   static stbi_uc out[(W*3 + 5) * (H + 1)];
+   stbi_uc *ref;
+   int x, y, n, i, r;
+
+   check_bad(f, name, NULL, 0, 0);
+   check_bad(f, name, NULL, W*3, H);
+   check_bad(f, name, out, 0, H);
+   check_bad(f, name, out, W*3, 0);
+   check_bad(f, name, out, -W*3, H);
+   check_bad(f, name, out, W*3, -1);
+   check_bad(f, name, out, W*3 - 1, H);
+   check_bad(f, name, out, W*3, H - 1);
+
+   ref = stbi_load_from_memory(f->data, f->len, &x, &y, &n, 3);
+   expect(ref != NULL && x == W && y == H, "stbi_load_from_memory failed", name);
+   if (ref == NULL) return;
+
+   memset(out, 0xcd, sizeof(out));
+   r = stbi_load_into_from_memory(f->data, f->len, &x, &y, &n, 3, out, W*3 + 5, H + 1);
+   expect(r == 1 && x == W && y == H, "stbi_load_into_from_memory failed", name);
+   for (i=0; r && i < H; ++i)
+      if (memcmp(out + i*(W*3 + 5), ref + i*W*3, W*3) != 0) {
+         expect(0, "stbi_load_into_from_memory output differs from stbi_load", name);
+         break;
+      }
+
+   if (is_jpeg) {
+      stbi_jpeg_decoder *d = stbi_jpeg_decoder_create();
+      memset(out, 0xcd, sizeof(out));
+      r = stbi_jpeg_decoder_load_into(d, f->data, f->len, &x, &y, &n, 3, out, W*3, H);
+      expect(r == 1 && memcmp(out, ref, W*3*H) == 0, "stbi_jpeg_decoder_load_into failed", name);
+      stbi_jpeg_decoder_free(d);
+   }
+   stbi_image_free(ref);
+}
+
+int main(void)
+{
+   static mem_file jpg, png;
+   static stbi_uc pixels[W*H*3];
+   stbi_uc out[16];
+   int i, x, y, n;
+
+   for (i=0; i < W*H*3; ++i)
+      pixels[i] = (stbi_uc) (i * 7 + (i / (W*3)) * 13);
+   stbi_write_jpg_to_func(write_mem, &jpg, W, H, 3, pixels, 90);
+   stbi_write_png_to_func(write_mem, &png, W, H, 3, pixels, W*3);
+
+   check_file(&jpg, "jpeg", 1);
+   check_file(&png, "png", 0);
+
+   // the file versions check before opening anything
+   expect(stbi_load_into("pngsuite/primary/basn2c08.png", &x, &y, &n, 3, NULL, 0, 0) == 0,
+          "stbi_load_into accepted a bad destination", "basn2c08.png");
+   expect(stbi_load_into("pngsuite/primary/basn2c08.png", &x, &y, &n, 3, out, sizeof(out), 1) == 0,
+          "stbi_load_into accepted a buffer that is too small", "basn2c08.png");
+
+   if (errors) return 1;
+   printf("all ok!\n");
+   return 0;
+}
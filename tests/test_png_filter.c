@@ -0,0 +1,181 @@
+// Checks that the SIMD PNG unfiltering (Sub, Up, Average, Paeth on 3/4
+// channel, 8/16-bit rows) matches the generic C version, both on random
+// rows and on the real scanlines of every image in pngsuite/.
+//
+//    cd tests
+//    cc -O2 -I.. test_png_filter.c -lm -o test_png_filter
+//
+// With STBI_NO_SIMD (or on a target without SIMD kernels) there is nothing
+// to compare, and the test just passes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32 // what stb.h checks
+#pragma comment(lib, "advapi32.lib")
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include "stb_image.h"
+
+#define STB_DEFINE
+#include "deprecated/stb.h"
+
+#ifdef STBI__PNG_SIMD
+
+static unsigned int seed = 12345;
+
+static int rnd(int n)
+{
+   seed = seed * 1664525 + 1013904223;
+   return (int) ((seed >> 8) % (unsigned int) n);
+}
+
+// unfilter one row both ways; ref and out are nk bytes for the new row
+// followed by nk bytes holding the respective previous rows
+static int check_row(int filter, stbi_uc *ref, stbi_uc *out, stbi_uc const *raw, int nk, int filter_bytes, int first)
+{
+   if (first) filter = first_row_filter[filter];
+   stbi__png_unfilter_row(filter, ref, raw, ref + nk, nk, filter_bytes);
+   if (!stbi__png_unfilter_row_simd(filter, out, raw, out + nk, nk, filter_bytes))
+      stbi__png_unfilter_row(filter, out, raw, out + nk, nk, filter_bytes);
+   // this also catches writes past the end of the row
+   if (memcmp(ref, out, nk*2) != 0)
+      return 0;
+   memcpy(ref + nk, ref, nk);
+   memcpy(out + nk, out, nk);
+   return 1;
+}
+
+static int check_random(void)
+{
+   static const int sizes[4] = { 3, 4, 6, 8 };
+   stbi_uc raw[1024], ref[2048], out[2048];
+   int n, i;
+   for (n=0; n < 100000; ++n) {
+      int filter_bytes = sizes[rnd(4)];
+      int nk = filter_bytes * (1 + rnd(1024 / filter_bytes));
+      int filter = rnd(5);
+      for (i=0; i < nk; ++i) {
+         raw[i] = (stbi_uc) rnd(256);
+         ref[nk+i] = out[nk+i] = (stbi_uc) rnd(256);
+      }
+      if (!check_row(filter, ref, out, raw, nk, filter_bytes, n % 5 == 0)) {
+         printf("random row: mismatch for filter %d, %d bytes/pixel, %d bytes\n", filter, filter_bytes, nk);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static stbi__uint32 get32(stbi_uc const *p)
+{
+   return ((stbi__uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// inflate the IDAT data of a non-interlaced PNG with 3/4 channels and
+// unfilter every row both ways. returns the number of rows checked, or -1
+static int check_file(const char *filename)
+{
+   static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+   size_t len;
+   int zlen = 0, raw_len, rows = 0;
+   stbi_uc *file = (stbi_uc *) stb_file((char *) filename, &len);
+   stbi_uc *zdata = NULL, *p, *raw = NULL, *ref = NULL, *out = NULL;
+   stbi__uint32 w = 0, h = 0, y, nk = 0;
+   int filter_bytes = 0, interlace = 0;
+
+   if (!file) return 0;
+   for (p = file + 8; p + 12 <= file + len; p += 12 + get32(p)) {
+      stbi__uint32 clen = get32(p);
+      if (p + 12 + clen > file + len) break;
+      if (!memcmp(p+4, "IHDR", 4)) {
+         int depth = p[16], color = p[17];
+         w = get32(p+8);
+         h = get32(p+12);
+         interlace = p[20];
+         filter_bytes = (depth >= 8 && color <= 6) ? channels[color] * depth / 8 : 0;
+      } else if (!memcmp(p+4, "IDAT", 4)) {
+         zdata = (stbi_uc *) realloc(zdata, zlen + clen);
+         memcpy(zdata + zlen, p+8, clen);
+         zlen += clen;
+      }
+   }
+   free(file);
+
+   if (interlace || filter_bytes < 3 || !zdata) {
+      free(zdata);
+      return 0;
+   }
+
+   raw = (stbi_uc *) stbi_zlib_decode_malloc((char *) zdata, zlen, &raw_len);
+   free(zdata);
+   nk = w * filter_bytes;
+   if (!raw || (stbi__uint32) raw_len < (nk+1) * h) {
+      free(raw);
+      return 0;
+   }
+
+   ref = (stbi_uc *) calloc(nk, 2);
+   out = (stbi_uc *) calloc(nk, 2);
+   for (y=0; y < h; ++y) {
+      stbi_uc *row = raw + y*(nk+1);
+      if (row[0] > 4 || !check_row(row[0], ref, out, row+1, nk, filter_bytes, y == 0)) {
+         printf("%s: mismatch on row %d (filter %d)\n", filename, (int) y, row[0]);
+         rows = -1;
+         break;
+      }
+      ++rows;
+   }
+   free(ref);
+   free(out);
+   free(raw);
+   return rows;
+}
+
+static int check_pngsuite(void)
+{
+   char **files = stb_readdir_recursive("pngsuite", "*.png");
+   int i, errors = 0, rows = 0, nfiles = 0;
+   if (!files) {
+      printf("pngsuite files not found!\n");
+      return 1;
+   }
+   for (i=0; i < stb_arr_len(files); ++i) {
+      int n = check_file(files[i]);
+      if (n < 0) ++errors;
+      if (n > 0) {
+         rows += n;
+         ++nfiles;
+      }
+   }
+   stb_readdir_free(files);
+   printf("checked %d rows from %d pngsuite files\n", rows, nfiles);
+   return errors;
+}
+
+int main(void)
+{
+   int errors = 0;
+   errors += check_random();
+   errors += check_pngsuite();
+   if (errors)
+      return 1;
+   printf("all ok!\n");
+   return 0;
+}
+
+#else
+
+int main(void)
+{
+   printf("no SIMD kernels in this build, nothing to check\n");
+   return 0;
+}
+
+#endif
+
+// vim:sw=3:sts=3:et